@@ -0,0 +1,81 @@
+#include "fft.h"
+
+#include <stdlib.h>
+#include <math.h>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+bool fft_init(struct fft *fft, unsigned n) {
+  unsigned bits = 0;
+  while ((1u << bits) < n) bits++;
+  if ((1u << bits) != n || n < 2) return false;
+  fft->n = n;
+  fft->bits = bits;
+  fft->twr = malloc(sizeof(float) * (n-1));
+  fft->twi = malloc(sizeof(float) * (n-1));
+  fft->rev = malloc(sizeof(unsigned) * n);
+  if (!fft->twr || !fft->twi || !fft->rev) {
+    fft_free(fft);
+    return false;
+  }
+  // one table per stage at offset half-1, so the butterflies read their
+  // twiddles contiguously instead of every n/(2*half)th entry
+  for (unsigned half = 1; half < n; half <<= 1) {
+    for (unsigned k = 0; k < half; k++) {
+      fft->twr[half-1+k] = cos(-M_PI * k / half);
+      fft->twi[half-1+k] = sin(-M_PI * k / half);
+    }
+  }
+  for (unsigned i = 0; i < n; i++) {
+    unsigned r = 0;
+    for (unsigned b = 0; b < bits; b++) {
+      if (i & (1u << b)) r |= 1u << (bits-1-b);
+    }
+    fft->rev[i] = r;
+  }
+  return true;
+}
+
+void fft_free(struct fft *fft) {
+  free(fft->twr);
+  free(fft->twi);
+  free(fft->rev);
+  fft->twr = 0;
+  fft->twi = 0;
+  fft->rev = 0;
+}
+
+// one block of a stage, a and b are the two halves. restrict on the
+// parameters lets gcc -O3 vectorize this, block scope pointers do not.
+static void fft_butterflies(float *restrict ar, float *restrict ai,
+                            float *restrict br, float *restrict bi,
+                            const float *restrict twr, const float *restrict twi,
+                            unsigned half) {
+  for (unsigned k = 0; k < half; k++) {
+    float tr = br[k]*twr[k] - bi[k]*twi[k];
+    float ti = br[k]*twi[k] + bi[k]*twr[k];
+    br[k] = ar[k] - tr;
+    bi[k] = ai[k] - ti;
+    ar[k] += tr;
+    ai[k] += ti;
+  }
+}
+
+void fft_run(const struct fft *fft, float *re, float *im) {
+  unsigned n = fft->n;
+  for (unsigned i = 0; i < n; i++) {
+    unsigned r = fft->rev[i];
+    if (r <= i) continue;
+    float t = re[i]; re[i] = re[r]; re[r] = t;
+    t = im[i]; im[i] = im[r]; im[r] = t;
+  }
+  for (unsigned half = 1; half < n; half <<= 1) {
+    const float *twr = fft->twr + half-1, *twi = fft->twi + half-1;
+    for (unsigned base = 0; base < n; base += 2*half) {
+      fft_butterflies(re + base, im + base, re + base + half, im + base + half,
+                      twr, twi, half);
+    }
+  }
+}
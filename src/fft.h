@@ -0,0 +1,22 @@
+#ifndef OPNATEST_FFT_H_INCLUDED
+#define OPNATEST_FFT_H_INCLUDED
+
+#include <stdbool.h>
+
+// radix-2 complex fft with precomputed twiddles, split re/im arrays
+struct fft {
+  unsigned n;
+  unsigned bits;
+  // n-1 twiddles, the stage of half-size h at offset h-1
+  float *twr;
+  float *twi;
+  unsigned *rev;
+};
+
+// n must be a power of 2
+bool fft_init(struct fft *fft, unsigned n);
+void fft_free(struct fft *fft);
+// in place, forward
+void fft_run(const struct fft *fft, float *re, float *im);
+
+#endif /* OPNATEST_FFT_H_INCLUDED */
@@ -0,0 +1,188 @@
+// renders a patch over the whole key range into one wav, a note per slice
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "opnabank.h"
+#include "opnaprof.h"
+#include "fnumtable.h"
+#include "wavfile.h"
+
+#define BLOCK 4096
+// octaves 0-7, c to b
+#define NOTES (8*12)
+#define THREADS_MAX 256
+
+struct bake {
+  struct fm_patch patch;
+  int fd;
+  // samples of each note
+  uint32_t hold;
+  uint32_t release;
+  // next note to take
+  atomic_uint next;
+  atomic_bool failed;
+};
+
+// sequential, from offset on
+static bool write_le16(int fd, const int16_t *buf, unsigned len, off_t offset) {
+  uint8_t le[BLOCK*2];
+  for (unsigned i = 0; i < len; i++) {
+    le[2*i] = buf[i];
+    le[2*i+1] = (uint16_t)buf[i] >> 8;
+  }
+  size_t size = len * 2;
+  for (size_t done = 0; done < size;) {
+    ssize_t r = pwrite(fd, le + done, size - done, offset + done);
+    if (r <= 0) return false;
+    done += r;
+  }
+  return true;
+}
+
+// key on, hold, key off and release of one note straight to its slice
+static bool bake_note(struct bake *bake, unsigned note) {
+  int32_t buf[BLOCK];
+  int16_t obuf[BLOCK];
+  struct fm_channel chan;
+  fm_chan_reset(&chan);
+  fm_chan_set_patch(&chan, &bake->patch);
+  fm_chan_set_blkfnum(&chan, note / 12, fnumtable_fmp[note % 12]);
+  for (int s = 0; s < 4; s++) fm_slot_key(&chan, s, true);
+  uint32_t frames = bake->hold + bake->release;
+  off_t offset = WAVFILE_HEADER + (off_t)note * frames * 2;
+  unsigned env_div3 = 0;
+  for (uint32_t pos = 0; pos < frames;) {
+    if (pos == bake->hold) {
+      for (int s = 0; s < 4; s++) fm_slot_key(&chan, s, false);
+    }
+    uint32_t until = pos < bake->hold ? bake->hold : frames;
+    unsigned len = BLOCK;
+    if (len > until - pos) len = until - pos;
+    memset(buf, 0, sizeof(int32_t) * len);
+    fm_chan_render(&chan, buf, len, env_div3);
+    env_div3 = (env_div3 + 3 - (len % 3)) % 3;
+    wavfile_convert(obuf, buf, len);
+    if (!write_le16(bake->fd, obuf, len, offset + (off_t)pos * 2)) return false;
+    pos += len;
+  }
+  return true;
+}
+
+static void *bake_thread(void *ptr) {
+  struct bake *bake = ptr;
+  while (!atomic_load(&bake->failed)) {
+    unsigned note = atomic_fetch_add(&bake->next, 1);
+    if (note >= NOTES) break;
+    if (!bake_note(bake, note)) atomic_store(&bake->failed, true);
+  }
+  return 0;
+}
+
+static void usage(const char *name) {
+  printf("usage: %s [-b bank [-p name]] [-j threads] [-k ms] [-r ms] out.wav\n", name);
+  printf("  -b bank     take the voice from a bank, the editor stores its voice with F4\n");
+  printf("  -p name     voice to take from the bank (default the first)\n");
+  printf("  -j threads  notes rendered at once (default one per cpu)\n");
+  printf("  -k ms       key held for this long (default 1000)\n");
+  printf("  -r ms       release rendered after key off (default 1000)\n");
+  printf("out.wav is mono, note n (0 is o0 c, %d is o7 b) starts at frame n * (hold + release)\n",
+         NOTES - 1);
+}
+
+int main(int argc, char **argv) {
+  const char *bankpath = 0, *name = 0;
+  long threads = sysconf(_SC_NPROCESSORS_ONLN);
+  int hold_ms = 1000, release_ms = 1000;
+  int argi = 1;
+  while (argi+1 < argc && argv[argi][0] == '-') {
+    if (!strcmp(argv[argi], "-b")) {
+      bankpath = argv[argi+1];
+    } else if (!strcmp(argv[argi], "-p")) {
+      name = argv[argi+1];
+    } else if (!strcmp(argv[argi], "-j")) {
+      threads = atoi(argv[argi+1]);
+    } else if (!strcmp(argv[argi], "-k")) {
+      hold_ms = atoi(argv[argi+1]);
+    } else if (!strcmp(argv[argi], "-r")) {
+      release_ms = atoi(argv[argi+1]);
+    } else {
+      break;
+    }
+    argi += 2;
+  }
+  if (threads < 1) threads = 1;
+  if (threads > THREADS_MAX) threads = THREADS_MAX;
+  // the whole bank has to fit the 32bit wav sizes
+  if (argc - argi != 1 || (name && !bankpath) || hold_ms < 1 || release_ms < 0 ||
+      ((uint64_t)hold_ms + (uint64_t)release_ms) * FM_OPNA_SAMPLERATE / 1000 * NOTES * 2 > UINT32_MAX - 64) {
+    usage(argv[0]);
+    return 1;
+  }
+  const char *outpath = argv[argi];
+
+  static struct bake bake;
+  bake.hold = (uint64_t)hold_ms * FM_OPNA_SAMPLERATE / 1000;
+  bake.release = (uint64_t)release_ms * FM_OPNA_SAMPLERATE / 1000;
+  atomic_init(&bake.next, 0);
+  atomic_init(&bake.failed, false);
+
+  struct opna_bankpatch bp;
+  if (bankpath) {
+    struct opna_bank bank;
+    if (!opna_bank_open(&bank, bankpath)) {
+      fprintf(stderr, "cannot open bank %s\n", bankpath);
+      return 1;
+    }
+    long n = name ? opna_bank_find(&bank, name) : (bank.count ? 0 : -1);
+    if (n < 0) {
+      fprintf(stderr, "%s: no voice %s\n", bankpath, name ? name : "in bank");
+      opna_bank_close(&bank);
+      return 1;
+    }
+    bp = bank.patch[n];
+    opna_bank_close(&bank);
+  } else {
+    opna_bankpatch_default(&bp);
+  }
+  bake.patch = bp.patch;
+
+  bake.fd = open(outpath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (bake.fd < 0) {
+    fprintf(stderr, "cannot write %s\n", outpath);
+    return 1;
+  }
+  uint32_t frames = (bake.hold + bake.release) * NOTES;
+  uint8_t h[WAVFILE_HEADER];
+  wavfile_header(h, FM_OPNA_SAMPLERATE, 1, frames);
+  if (pwrite(bake.fd, h, sizeof(h), 0) != sizeof(h)) goto err_write;
+
+  uint64_t start = opna_prof_now();
+  pthread_t thread[THREADS_MAX];
+  long started = 0;
+  for (; started < threads; started++) {
+    if (pthread_create(&thread[started], 0, bake_thread, &bake)) break;
+  }
+  // with no thread at all the notes are rendered here
+  if (!started) bake_thread(&bake);
+  for (long i = 0; i < started; i++) pthread_join(thread[i], 0);
+  if (atomic_load(&bake.failed)) goto err_write;
+  if (close(bake.fd)) {
+    bake.fd = -1;
+    goto err_write;
+  }
+  bake.fd = -1;
+  double sec = (double)(opna_prof_now() - start) / 1e9;
+  double len = (double)frames / FM_OPNA_SAMPLERATE;
+  printf("%s: %d notes of %u frames (%.1fs of audio) with %ld threads in %.2fs (%.1fx real time)\n",
+         outpath, NOTES, bake.hold + bake.release, len, started ? started : 1, sec,
+         sec > 0 ? len / sec : 0.0);
+  return 0;
+err_write:
+  fprintf(stderr, "error writing %s\n", outpath);
+  if (bake.fd >= 0) close(bake.fd);
+  return 1;
+}
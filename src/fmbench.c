@@ -0,0 +1,276 @@
+// microbenchmarks of the synthesis hot path, built against opnafm.c
+// itself so that the static helpers can be timed in isolation
+#include "opnafm.c"
+#include "opnaprof.h"
+#include "fnumtable.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+enum {
+  CTR_CYCLES,
+  CTR_INSTRUCTIONS,
+  CTR_BRANCH_MISSES,
+  CTR_L1D_MISSES,
+  CTR_NUM
+};
+
+static const char *const ctr_name[CTR_NUM] = {
+  "cycles", "instructions", "branch misses", "l1d misses",
+};
+
+// -1 where the counter could not be opened
+static int ctr_fd[CTR_NUM] = {-1, -1, -1, -1};
+
+#ifdef __linux__
+static int ctr_open(uint32_t type, uint64_t config) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = type;
+  attr.config = config;
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#endif
+
+// false when no counter is available, timing still works
+static bool ctr_init(void) {
+  bool any = false;
+#ifdef __linux__
+  ctr_fd[CTR_CYCLES] = ctr_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+  ctr_fd[CTR_INSTRUCTIONS] = ctr_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+  ctr_fd[CTR_BRANCH_MISSES] = ctr_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+  ctr_fd[CTR_L1D_MISSES] = ctr_open(PERF_TYPE_HW_CACHE,
+                                    PERF_COUNT_HW_CACHE_L1D |
+                                    (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                    (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+  for (int i = 0; i < CTR_NUM; i++) {
+    if (ctr_fd[i] >= 0) any = true;
+    else fprintf(stderr, "%s: not available\n", ctr_name[i]);
+  }
+#endif
+  return any;
+}
+
+static void ctr_start(void) {
+#ifdef __linux__
+  for (int i = 0; i < CTR_NUM; i++) {
+    if (ctr_fd[i] < 0) continue;
+    ioctl(ctr_fd[i], PERF_EVENT_IOC_RESET, 0);
+    ioctl(ctr_fd[i], PERF_EVENT_IOC_ENABLE, 0);
+  }
+#endif
+}
+
+static void ctr_stop(uint64_t val[CTR_NUM]) {
+  for (int i = 0; i < CTR_NUM; i++) {
+    val[i] = 0;
+#ifdef __linux__
+    if (ctr_fd[i] < 0) continue;
+    ioctl(ctr_fd[i], PERF_EVENT_IOC_DISABLE, 0);
+    if (read(ctr_fd[i], &val[i], sizeof(val[i])) != sizeof(val[i])) val[i] = 0;
+#endif
+  }
+}
+
+static volatile int32_t sink;
+
+// a patch with feedback and every slot audible, keyed on at a mid pitch
+static void bench_chan(struct fm_channel *chan, unsigned alg) {
+  static const struct fm_patch patch = {
+    4, 5, {
+      {31, 8, 2, 6, 3, 28, 1, 2, 0},
+      {31, 6, 2, 7, 2, 0, 1, 1, 0},
+      {31, 8, 2, 6, 3, 32, 1, 1, 0},
+      {31, 6, 2, 7, 2, 0, 1, 1, 0},
+    }
+  };
+  fm_chan_reset(chan);
+  fm_chan_set_patch(chan, &patch);
+  fm_chan_set_alg(chan, alg);
+  fm_chan_set_blkfnum(chan, 4, fnumtable_fmp[9]);
+  for (int s = 0; s < 4; s++) fm_slot_key(chan, s, true);
+}
+
+struct bench {
+  const char *name;
+  // output samples one call accounts for, 0 if none
+  double samples_per_call;
+  void (*run)(unsigned arg, unsigned calls);
+  unsigned arg;
+};
+
+static void run_slotout(unsigned arg, unsigned calls) {
+  struct fm_channel chan;
+  bench_chan(&chan, arg);
+  int32_t acc = 0;
+  int16_t mod = 0;
+  for (unsigned i = 0; i < calls; i++) {
+    struct fm_slot *slot = &chan.slot[i & 3];
+    mod = fm_slotout(slot, mod);
+    acc += mod;
+    slot->phase += 0x12345;
+  }
+  sink = acc;
+}
+
+static void run_slotenv(unsigned arg, unsigned calls) {
+  struct fm_channel chan;
+  bench_chan(&chan, arg);
+  int32_t acc = 0;
+  for (unsigned i = 0; i < calls; i++) {
+    acc += fm_slotenv(&chan.slot[i & 3]);
+    // restart the envelopes now and then so all states are visited
+    if (!(i & 0xffff)) {
+      for (int s = 0; s < 4; s++) fm_slot_key(&chan, s, false);
+    } else if (!(i & 0x7fff)) {
+      for (int s = 0; s < 4; s++) fm_slot_key(&chan, s, true);
+    }
+  }
+  sink = acc;
+}
+
+static void run_chanout(unsigned arg, unsigned calls) {
+  struct fm_channel chan;
+  bench_chan(&chan, arg);
+  int32_t acc = 0;
+  for (unsigned i = 0; i < calls; i++) {
+    acc += fm_chanout(&chan);
+    fm_chanphase(&chan);
+  }
+  sink = acc;
+}
+
+// the register mix of a note on: slot parameters, pitch and key
+static void run_writereg(unsigned arg, unsigned calls) {
+  (void)arg;
+  static const uint16_t regs[] = {
+    0x30, 0x40, 0x50, 0x60, 0x70, 0x80, 0x34, 0x44, 0xb0, 0xb4, 0xa4, 0xa0, 0x28, 0x28,
+  };
+  struct fm_opna opna;
+  memset(&opna, 0, sizeof(opna));
+  fm_opna_reset(&opna);
+  unsigned n = sizeof(regs) / sizeof(regs[0]);
+  for (unsigned i = 0; i < calls; i++) {
+    unsigned k = i % n;
+    unsigned c = (i / n) % 6;
+    unsigned reg = regs[k];
+    unsigned val = i * 37;
+    if (reg == 0x28) {
+      val = (k == n-1 ? 0xf0 : 0) | (c < 3 ? c : c + 1);
+    } else {
+      reg += (c < 3 ? c : 0x100 + c - 3);
+    }
+    fm_opna_fmwritereg(&opna, reg, val);
+  }
+  sink = opna.channel[0].slot[0].tl;
+}
+
+static void run_render(unsigned arg, unsigned calls) {
+  (void)arg;
+  static int16_t buf[2*256];
+  struct fm_opna opna;
+  memset(&opna, 0, sizeof(opna));
+  fm_opna_reset(&opna);
+  for (int c = 0; c < 6; c++) bench_chan(&opna.channel[c], c);
+  for (unsigned i = 0; i < calls; i++) {
+    fm_opna_render(&opna, FM_OPNA_S16, buf, 0, 256);
+  }
+  sink = buf[0];
+}
+
+#define ALGS(name, samples, run) \
+  {name " alg0", samples, run, 0}, {name " alg1", samples, run, 1}, \
+  {name " alg2", samples, run, 2}, {name " alg3", samples, run, 3}, \
+  {name " alg4", samples, run, 4}, {name " alg5", samples, run, 5}, \
+  {name " alg6", samples, run, 6}, {name " alg7", samples, run, 7}
+
+static const struct bench benches[] = {
+  // a channel sample takes 4 slot outputs and a third of 4 envelope steps
+  {"fm_slotout", 0.25, run_slotout, 4},
+  {"fm_slotenv", 0.75, run_slotenv, 4},
+  ALGS("fm_chanout", 1.0, run_chanout),
+  {"fm_opna_fmwritereg", 0, run_writereg, 0},
+  // 6 channels of 256 samples
+  {"fm_opna_render s16", 256, run_render, 0},
+};
+#undef ALGS
+
+static void usage(const char *name) {
+  printf("usage: %s [-n calls] [-r repeat] [filter]\n", name);
+  printf("  -n calls   calls per measurement (default 1048576, render uses 1/256)\n");
+  printf("  -r repeat  measurements per benchmark, the fastest is shown (default 5)\n");
+  printf("  filter     only benchmarks whose name contains this\n");
+}
+
+int main(int argc, char **argv) {
+  unsigned calls = 1u << 20;
+  int repeat = 5;
+  const char *filter = 0;
+  int argi = 1;
+  while (argi+1 < argc && argv[argi][0] == '-') {
+    if (!strcmp(argv[argi], "-n")) {
+      calls = atoi(argv[argi+1]);
+    } else if (!strcmp(argv[argi], "-r")) {
+      repeat = atoi(argv[argi+1]);
+    } else {
+      break;
+    }
+    argi += 2;
+  }
+  if (argi < argc && argv[argi][0] != '-') filter = argv[argi++];
+  if (argi != argc || calls < 256 || repeat < 1) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  bool counters = ctr_init();
+  if (!counters) fprintf(stderr, "no performance counters, timing only\n");
+  printf("%-22s %9s %9s %9s %6s %9s %9s %9s\n", "per call", "ns", "cycles",
+         "instr", "ipc", "br miss", "l1d miss", "ns/sample");
+  for (size_t b = 0; b < sizeof(benches) / sizeof(benches[0]); b++) {
+    const struct bench *bench = &benches[b];
+    if (filter && !strstr(bench->name, filter)) continue;
+    unsigned n = bench->samples_per_call > 1 ? calls / 256 : calls;
+    uint64_t best_ns = UINT64_MAX, best[CTR_NUM] = {0};
+    for (int r = 0; r < repeat; r++) {
+      uint64_t val[CTR_NUM];
+      uint64_t start = opna_prof_now();
+      ctr_start();
+      bench->run(bench->arg, n);
+      ctr_stop(val);
+      uint64_t ns = opna_prof_now() - start;
+      if (ns < best_ns) {
+        best_ns = ns;
+        memcpy(best, val, sizeof(best));
+      }
+    }
+    printf("%-22s %9.2f", bench->name, (double)best_ns / n);
+    for (int i = 0; i < CTR_NUM; i++) {
+      if (i == CTR_BRANCH_MISSES) {
+        double ipc = best[CTR_CYCLES] ? (double)best[CTR_INSTRUCTIONS] / best[CTR_CYCLES] : 0;
+        if (ctr_fd[CTR_CYCLES] >= 0 && ctr_fd[CTR_INSTRUCTIONS] >= 0) printf(" %6.2f", ipc);
+        else printf(" %6s", "-");
+      }
+      if (ctr_fd[i] >= 0) printf(" %9.3f", (double)best[i] / n);
+      else printf(" %9s", "-");
+    }
+    if (bench->samples_per_call) {
+      printf(" %9.3f\n", (double)best_ns / (n * bench->samples_per_call));
+    } else {
+      printf(" %9s\n", "-");
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,508 @@
+#include "fmvoice.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+struct fm_voicepatch {
+  struct fm_patch patch;
+  uint32_t serial;
+  struct fm_voicepatch *next;
+};
+
+// samples between channel snapshots of a cached note
+#define CACHE_SNAP 256
+// 4 slots of 9 parameters, alg, fb, blk, fnum, fbmem1, fbmem2, alg_mem, env_div3
+#define CACHE_KEYLEN 48
+// entries looked at per lookup
+#define CACHE_PROBE 8
+
+struct fm_notecache_entry {
+  uint64_t hash;
+  uint8_t key[CACHE_KEYLEN];
+  // len samples of output, a multiple of CACHE_SNAP up to the cache length
+  int16_t *samples;
+  uint32_t len;
+  // snap[i]: channel after i*CACHE_SNAP samples
+  struct fm_channel *snap;
+  // voices playing or recording this entry, it is not replaced while used
+  uint16_t users;
+  bool valid;
+  // a voice is appending to it, len is not final yet
+  bool recording;
+  // lru
+  uint32_t used;
+};
+
+struct fm_notecache {
+  struct fm_notecache_entry *entry;
+  // power of 2
+  unsigned count;
+  // samples per entry, a multiple of CACHE_SNAP
+  uint32_t len;
+  uint32_t clock;
+};
+
+static void fm_notecache_free(struct fm_notecache *cache) {
+  if (!cache) return;
+  if (cache->entry) {
+    for (unsigned i = 0; i < cache->count; i++) {
+      free(cache->entry[i].samples);
+      free(cache->entry[i].snap);
+    }
+  }
+  free(cache->entry);
+  free(cache);
+}
+
+static struct fm_notecache *fm_notecache_new(unsigned entries, uint32_t len) {
+  struct fm_notecache *cache = calloc(1, sizeof(*cache));
+  if (!cache) return 0;
+  unsigned count = 1;
+  while (count < entries) count <<= 1;
+  cache->count = count;
+  cache->len = len;
+  cache->entry = calloc(count, sizeof(*cache->entry));
+  if (!cache->entry) goto err;
+  for (unsigned i = 0; i < count; i++) {
+    struct fm_notecache_entry *e = &cache->entry[i];
+    e->samples = malloc(sizeof(*e->samples) * len);
+    e->snap = malloc(sizeof(*e->snap) * (len / CACHE_SNAP + 1));
+    if (!e->samples || !e->snap) goto err;
+  }
+  return cache;
+err:
+  fm_notecache_free(cache);
+  return 0;
+}
+
+// false unless every slot is fully attenuated, the only state in which
+// a key on does not depend on what played before
+static bool fm_notecache_key(const struct fm_channel *chan, unsigned env_div3,
+                             uint8_t key[CACHE_KEYLEN]) {
+  uint8_t *p = key;
+  for (int s = 0; s < 4; s++) {
+    const struct fm_slot *slot = &chan->slot[s];
+    if (slot->env != 1023) return false;
+    *p++ = slot->ar;
+    *p++ = slot->dr;
+    *p++ = slot->sr;
+    *p++ = slot->rr;
+    *p++ = slot->sl;
+    *p++ = slot->tl;
+    *p++ = slot->ks;
+    *p++ = slot->mul;
+    *p++ = slot->det;
+  }
+  *p++ = chan->alg;
+  *p++ = chan->fb;
+  *p++ = chan->blk;
+  *p++ = chan->fnum;
+  *p++ = chan->fnum >> 8;
+  *p++ = chan->fbmem1;
+  *p++ = chan->fbmem1 >> 8;
+  *p++ = chan->fbmem2;
+  *p++ = chan->fbmem2 >> 8;
+  *p++ = chan->alg_mem;
+  *p++ = chan->alg_mem >> 8;
+  *p++ = env_div3;
+  return true;
+}
+
+static uint64_t fm_notecache_hash(const uint8_t key[CACHE_KEYLEN]) {
+  // fnv-1a
+  uint64_t h = 14695981039346656037ull;
+  for (int i = 0; i < CACHE_KEYLEN; i++) {
+    h ^= key[i];
+    h *= 1099511628211ull;
+  }
+  return h;
+}
+
+// env_div3 after pos samples of a note keyed on at div3
+static unsigned fm_voice_div3(const struct fm_voice *voice, uint32_t pos) {
+  return (voice->cache_div3 + 3 - (pos % 3)) % 3;
+}
+
+// back to plain synthesis at exactly cache_pos. a recording keeps what
+// it has up to the last snapshot, a later playback may extend it
+static void fm_voice_cache_stop(struct fm_voice *voice) {
+  struct fm_notecache_entry *e = voice->cache;
+  if (!e) return;
+  voice->cache = 0;
+  e->users--;
+  if (voice->recording) {
+    e->recording = false;
+    if (!e->len) e->valid = false;
+    return;
+  }
+  uint32_t from = voice->cache_pos - voice->cache_pos % CACHE_SNAP;
+  int32_t scratch[CACHE_SNAP];
+  unsigned len = voice->cache_pos - from;
+  for (unsigned i = 0; i < len; i++) scratch[i] = 0;
+  fm_chan_render(&voice->chan, scratch, len, fm_voice_div3(voice, from));
+}
+
+// after a key on, takes a cached note or starts recording one
+static void fm_voice_cache_start(struct fm_voicepool *pool, struct fm_voice *voice) {
+  struct fm_notecache *cache = pool->cache;
+  uint8_t key[CACHE_KEYLEN];
+  if (!fm_notecache_key(&voice->chan, pool->env_div3, key)) return;
+  uint64_t hash = fm_notecache_hash(key);
+  struct fm_notecache_entry *victim = 0;
+  for (unsigned i = 0; i < CACHE_PROBE && i < cache->count; i++) {
+    struct fm_notecache_entry *e = &cache->entry[(hash + i) & (cache->count - 1)];
+    if (e->valid && e->hash == hash && !memcmp(e->key, key, CACHE_KEYLEN)) {
+      if (e->recording) {
+        pool->cache_misses++;
+        return;
+      }
+      e->users++;
+      e->used = ++cache->clock;
+      voice->cache = e;
+      voice->recording = false;
+      voice->cache_pos = 0;
+      voice->cache_div3 = pool->env_div3;
+      pool->cache_hits++;
+      return;
+    }
+    if (e->users) continue;
+    if (!victim || !e->valid ||
+        (victim->valid && (int32_t)(e->used - victim->used) < 0)) {
+      victim = e;
+    }
+  }
+  pool->cache_misses++;
+  if (!victim) return;
+  victim->valid = true;
+  victim->hash = hash;
+  memcpy(victim->key, key, CACHE_KEYLEN);
+  victim->len = 0;
+  victim->recording = true;
+  victim->snap[0] = voice->chan;
+  victim->users = 1;
+  victim->used = ++cache->clock;
+  voice->cache = victim;
+  voice->recording = true;
+  voice->cache_pos = 0;
+  voice->cache_div3 = pool->env_div3;
+}
+
+static void fm_voice_cache_restore(struct fm_voice *voice, uint32_t i) {
+  const struct fm_notecache_entry *e = voice->cache;
+#ifdef LIBOPNA_ENABLE_STATS
+  // counted as if this voice had rendered the span itself
+  uint64_t transitions = voice->chan.env_transitions +
+                         e->snap[i].env_transitions - e->snap[i-1].env_transitions;
+  voice->chan = e->snap[i];
+  voice->chan.env_transitions = transitions;
+#else
+  voice->chan = e->snap[i];
+#endif
+}
+
+// at the end of a playback, the snapshot is exact and synthesis carries
+// on from it, recording the rest if this is the only voice on the entry
+static void fm_voice_cache_extend(struct fm_voice *voice, uint32_t end) {
+  struct fm_notecache_entry *e = voice->cache;
+  if (e->len < end && e->users == 1) {
+    e->recording = true;
+    voice->recording = true;
+  } else {
+    voice->cache = 0;
+    e->users--;
+  }
+}
+
+static void fm_voice_cache_render(const struct fm_voicepool *pool, struct fm_voice *voice,
+                                  int32_t *buf, unsigned len) {
+  struct fm_notecache_entry *e = voice->cache;
+  uint32_t end = pool->cache->len;
+  unsigned done = 0;
+  while (done < len && voice->cache) {
+    uint32_t pos = voice->cache_pos;
+    unsigned n = CACHE_SNAP - pos % CACHE_SNAP;
+    if (n > len - done) n = len - done;
+    if (voice->recording) {
+      int32_t out[CACHE_SNAP];
+      for (unsigned i = 0; i < n; i++) out[i] = 0;
+      fm_chan_render(&voice->chan, out, n, fm_voice_div3(voice, pos));
+      for (unsigned i = 0; i < n; i++) {
+        buf[done+i] += out[i];
+        e->samples[pos+i] = out[i];
+      }
+    } else {
+      for (unsigned i = 0; i < n; i++) buf[done+i] += e->samples[pos+i];
+    }
+    done += n;
+    pos += n;
+    voice->cache_pos = pos;
+    if (pos % CACHE_SNAP) continue;
+    if (voice->recording) {
+      e->snap[pos / CACHE_SNAP] = voice->chan;
+      e->len = pos;
+      if (pos == end) fm_voice_cache_stop(voice);
+    } else {
+      fm_voice_cache_restore(voice, pos / CACHE_SNAP);
+      if (pos == e->len) fm_voice_cache_extend(voice, end);
+    }
+  }
+  if (done < len) {
+    fm_chan_render(&voice->chan, buf+done, len-done, fm_voice_div3(voice, voice->cache_pos));
+  }
+}
+
+bool fm_voicepool_set_cache(struct fm_voicepool *pool, unsigned entries, unsigned ms) {
+  for (unsigned i = 0; i < pool->count; i++) fm_voice_cache_stop(&pool->voice[i]);
+  fm_notecache_free(pool->cache);
+  pool->cache = 0;
+  if (!entries || !ms) return true;
+  uint32_t len = (uint64_t)ms * FM_OPNA_SAMPLERATE / 1000;
+  len = (len + CACHE_SNAP - 1) / CACHE_SNAP * CACHE_SNAP;
+  pool->cache = fm_notecache_new(entries, len);
+  return pool->cache;
+}
+
+bool fm_voicepool_init(struct fm_voicepool *pool, unsigned count) {
+  memset(pool, 0, sizeof(*pool));
+  if (!count || count > FM_VOICE_MAX) return false;
+  pool->voice = malloc(sizeof(*pool->voice) * count);
+  pool->live = malloc(sizeof(*pool->live) * count);
+  pool->idle = malloc(sizeof(*pool->idle) * count);
+  if (!pool->voice || !pool->live || !pool->idle) goto err;
+  pool->count = count;
+  for (unsigned i = 0; i < count; i++) {
+    fm_chan_reset(&pool->voice[i].chan);
+    pool->voice[i].key = 0;
+    pool->voice[i].serial = 0;
+    pool->voice[i].patch_serial = 0;
+    pool->voice[i].held = false;
+    pool->voice[i].cache = 0;
+    // lowest index allocated first
+    pool->idle[i] = count - 1 - i;
+  }
+  pool->nidle = count;
+  atomic_init(&pool->pending, 0);
+  atomic_init(&pool->retired, 0);
+  return true;
+err:
+  fm_voicepool_free(pool);
+  return false;
+}
+
+static void fm_voicepatch_free(struct fm_voicepatch *p) {
+  while (p) {
+    struct fm_voicepatch *next = p->next;
+    free(p);
+    p = next;
+  }
+}
+
+void fm_voicepool_free(struct fm_voicepool *pool) {
+  fm_voicepatch_free(atomic_exchange(&pool->pending, 0));
+  fm_voicepatch_free(atomic_exchange(&pool->retired, 0));
+  fm_voicepatch_free(pool->patch);
+  pool->patch = 0;
+  fm_notecache_free(pool->cache);
+  pool->cache = 0;
+  free(pool->voice);
+  free(pool->live);
+  free(pool->idle);
+  pool->voice = 0;
+  pool->live = 0;
+  pool->idle = 0;
+  pool->count = 0;
+  pool->nlive = 0;
+  pool->nidle = 0;
+}
+
+// attenuation of the loudest carrier, in env units
+static unsigned fm_voice_level(const struct fm_voice *voice) {
+  const struct fm_channel *chan = &voice->chan;
+  unsigned level = ~0u;
+  for (int s = 0; s < 4; s++) {
+    if (!(fm_carriers[chan->alg & 7] & (1<<s))) continue;
+    unsigned att = chan->slot[s].env + (chan->slot[s].tl << 3);
+    if (att < level) level = att;
+  }
+  return level;
+}
+
+static unsigned fm_voicepool_steal(struct fm_voicepool *pool) {
+  // voices playing back hold a snapshot, the levels must be the real ones
+  for (unsigned i = 0; i < pool->nlive; i++) {
+    struct fm_voice *voice = &pool->voice[pool->live[i]];
+    if (voice->cache && !voice->recording) fm_voice_cache_stop(voice);
+  }
+  unsigned best = pool->live[0];
+  unsigned best_level = fm_voice_level(&pool->voice[best]);
+  for (unsigned i = 1; i < pool->nlive; i++) {
+    unsigned v = pool->live[i];
+    unsigned level = fm_voice_level(&pool->voice[v]);
+    if (level > best_level ||
+        (level == best_level &&
+         (int32_t)(pool->voice[v].serial - pool->voice[best].serial) < 0)) {
+      best = v;
+      best_level = level;
+    }
+  }
+  struct fm_voice *voice = &pool->voice[best];
+  if (voice->held) pool->keymap[voice->key] = 0;
+  return best;
+}
+
+static void fm_voice_update(const struct fm_voicepool *pool, struct fm_voice *voice) {
+  if (!pool->patch || voice->patch_serial == pool->patch->serial) return;
+  fm_voice_cache_stop(voice);
+  fm_chan_set_patch(&voice->chan, &pool->patch->patch);
+  voice->patch_serial = pool->patch->serial;
+}
+
+bool fm_voicepool_set_patch(struct fm_voicepool *pool, const struct fm_patch *patch) {
+  // whatever the renderer replaced since the last call
+  fm_voicepatch_free(atomic_exchange_explicit(&pool->retired, 0, memory_order_acquire));
+  struct fm_voicepatch *p = malloc(sizeof(*p));
+  if (!p) return false;
+  p->patch = *patch;
+  p->serial = ++pool->patch_serial;
+  p->next = 0;
+  // not taken yet, the renderer never saw it
+  fm_voicepatch_free(atomic_exchange_explicit(&pool->pending, p, memory_order_acq_rel));
+  return true;
+}
+
+const struct fm_patch *fm_voicepool_patch(const struct fm_voicepool *pool, uint32_t *serial) {
+  if (!pool->patch) return 0;
+  *serial = pool->patch->serial;
+  return &pool->patch->patch;
+}
+
+// renderer side, no allocation or locking
+static void fm_voicepool_take_patch(struct fm_voicepool *pool) {
+  struct fm_voicepatch *p = atomic_exchange_explicit(&pool->pending, 0, memory_order_acq_rel);
+  if (!p) return;
+  struct fm_voicepatch *old = pool->patch;
+  pool->patch = p;
+  if (!old) return;
+  old->next = atomic_load_explicit(&pool->retired, memory_order_relaxed);
+  while (!atomic_compare_exchange_weak_explicit(&pool->retired, &old->next, old,
+                                                memory_order_release,
+                                                memory_order_relaxed));
+}
+
+struct fm_channel *fm_voicepool_keyon(struct fm_voicepool *pool, unsigned key,
+                                      unsigned blk, unsigned fnum) {
+  if (key >= FM_VOICE_KEYS) return 0;
+  if (pool->keymap[key]) fm_voicepool_keyoff(pool, key);
+  unsigned v;
+  if (pool->nidle) {
+    v = pool->idle[--pool->nidle];
+    pool->live[pool->nlive++] = v;
+  } else {
+    // already in live
+    v = fm_voicepool_steal(pool);
+  }
+  struct fm_voice *voice = &pool->voice[v];
+  fm_voice_cache_stop(voice);
+  voice->key = key;
+  voice->serial = pool->serial++;
+  voice->held = true;
+  pool->keymap[key] = v + 1;
+  fm_voice_update(pool, voice);
+  fm_chan_set_blkfnum(&voice->chan, blk, fnum);
+  for (int s = 0; s < 4; s++) {
+    // retrigger a stolen voice
+    voice->chan.slot[s].keyon = false;
+    fm_slot_key(&voice->chan, s, true);
+  }
+  if (pool->cache) fm_voice_cache_start(pool, voice);
+  return &voice->chan;
+}
+
+void fm_voicepool_keyoff(struct fm_voicepool *pool, unsigned key) {
+  if (key >= FM_VOICE_KEYS || !pool->keymap[key]) return;
+  struct fm_voice *voice = &pool->voice[pool->keymap[key] - 1];
+  pool->keymap[key] = 0;
+  voice->held = false;
+  fm_voice_cache_stop(voice);
+  for (int s = 0; s < 4; s++) {
+    fm_slot_key(&voice->chan, s, false);
+  }
+}
+
+static bool fm_voice_silent(const struct fm_voice *voice) {
+  if (voice->held) return false;
+  for (int s = 0; s < 4; s++) {
+    if (voice->chan.slot[s].env_state != ENV_OFF) return false;
+  }
+  return true;
+}
+
+void fm_voicepool_render(struct fm_voicepool *pool, int32_t *buf, unsigned len) {
+  fm_voicepool_take_patch(pool);
+  for (unsigned i = 0; i < pool->nlive; i++) {
+    struct fm_voice *voice = &pool->voice[pool->live[i]];
+    fm_voice_update(pool, voice);
+    if (voice->cache) fm_voice_cache_render(pool, voice, buf, len);
+    else fm_chan_render(&voice->chan, buf, len, pool->env_div3);
+  }
+  pool->env_div3 = (pool->env_div3 + 3 - (len % 3)) % 3;
+  for (unsigned i = pool->nlive; i--;) {
+    unsigned v = pool->live[i];
+    if (!fm_voice_silent(&pool->voice[v])) continue;
+    pool->live[i] = pool->live[--pool->nlive];
+    pool->idle[pool->nidle++] = v;
+  }
+}
+
+bool fm_voicepool_snap_init(struct fm_voicepool_snap *snap, const struct fm_voicepool *pool) {
+  memset(snap, 0, sizeof(*snap));
+  snap->voice = malloc(sizeof(*snap->voice) * pool->count);
+  snap->live = malloc(sizeof(*snap->live) * pool->count);
+  snap->idle = malloc(sizeof(*snap->idle) * pool->count);
+  if (!snap->voice || !snap->live || !snap->idle) {
+    fm_voicepool_snap_free(snap);
+    return false;
+  }
+  return true;
+}
+
+void fm_voicepool_snap_free(struct fm_voicepool_snap *snap) {
+  free(snap->voice);
+  free(snap->live);
+  free(snap->idle);
+  snap->voice = 0;
+  snap->live = 0;
+  snap->idle = 0;
+  snap->valid = false;
+}
+
+bool fm_voicepool_save(const struct fm_voicepool *pool, struct fm_voicepool_snap *snap) {
+  snap->valid = false;
+  if (pool->cache) return false;
+  memcpy(snap->voice, pool->voice, sizeof(*pool->voice) * pool->count);
+  memcpy(snap->live, pool->live, sizeof(*pool->live) * pool->nlive);
+  memcpy(snap->idle, pool->idle, sizeof(*pool->idle) * pool->nidle);
+  memcpy(snap->keymap, pool->keymap, sizeof(pool->keymap));
+  snap->nlive = pool->nlive;
+  snap->nidle = pool->nidle;
+  snap->serial = pool->serial;
+  snap->env_div3 = pool->env_div3;
+  snap->patch = pool->patch ? pool->patch->serial : 0;
+  snap->valid = true;
+  return true;
+}
+
+bool fm_voicepool_restore(struct fm_voicepool *pool, const struct fm_voicepool_snap *snap) {
+  // the patch of the snapshot may be freed already, serials are never reused
+  if (!snap->valid || pool->cache) return false;
+  if (snap->patch != (pool->patch ? pool->patch->serial : 0)) return false;
+  memcpy(pool->voice, snap->voice, sizeof(*pool->voice) * pool->count);
+  memcpy(pool->live, snap->live, sizeof(*pool->live) * snap->nlive);
+  memcpy(pool->idle, snap->idle, sizeof(*pool->idle) * snap->nidle);
+  memcpy(pool->keymap, snap->keymap, sizeof(pool->keymap));
+  pool->nlive = snap->nlive;
+  pool->nidle = snap->nidle;
+  pool->serial = snap->serial;
+  pool->env_div3 = snap->env_div3;
+  return true;
+}
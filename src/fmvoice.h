@@ -0,0 +1,120 @@
+#ifndef LIBOPNA_FMVOICE_H_INCLUDED
+#define LIBOPNA_FMVOICE_H_INCLUDED
+
+#include "opnafm.h"
+#include <stdatomic.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// keys are looked up directly, e.g. SDL scancodes or midi channel*128+note
+#define FM_VOICE_KEYS 2048
+#define FM_VOICE_MAX 256
+
+struct fm_notecache_entry;
+
+struct fm_voice {
+  struct fm_channel chan;
+  unsigned key;
+  // allocation order, the oldest of equally quiet voices is stolen first
+  uint32_t serial;
+  // of the patch last applied
+  uint32_t patch_serial;
+  bool held;
+  // note being played back from or recorded into the cache, NULL if none.
+  // while playing back, chan is the state at the last snapshot before cache_pos
+  struct fm_notecache_entry *cache;
+  uint32_t cache_pos;
+  bool recording;
+  // env_div3 of the pool at key on
+  uint8_t cache_div3;
+};
+
+struct fm_voicepatch;
+struct fm_notecache;
+
+// more fm_channel voices than the chip has, mono, rendered one voice
+// per block. idle voices cost nothing.
+struct fm_voicepool {
+  struct fm_voice *voice;
+  unsigned count;
+  // voice index + 1 of the voice holding key, 0 if none
+  uint16_t keymap[FM_VOICE_KEYS];
+  // voices with any slot not ENV_OFF or key held
+  uint16_t *live;
+  unsigned nlive;
+  uint16_t *idle;
+  unsigned nidle;
+  uint32_t serial;
+  uint8_t env_div3;
+
+  // set by fm_voicepool_set_patch, taken by the renderer at the next block
+  _Atomic(struct fm_voicepatch *) pending;
+  // renderer side, applied to live voices at block start and on key on
+  struct fm_voicepatch *patch;
+  // replaced by the renderer, freed by the next fm_voicepool_set_patch
+  _Atomic(struct fm_voicepatch *) retired;
+  uint32_t patch_serial;
+
+  // optional, see fm_voicepool_set_cache
+  struct fm_notecache *cache;
+  // key ons that played back from the cache, and clean ones that did not
+  uint64_t cache_hits;
+  uint64_t cache_misses;
+};
+
+// count: 1 to FM_VOICE_MAX
+bool fm_voicepool_init(struct fm_voicepool *pool, unsigned count);
+void fm_voicepool_free(struct fm_voicepool *pool);
+// key on and off by key, steals the quietest voice when all are busy.
+// returns NULL if key is out of range. the channel must not be changed
+// while the cache is enabled.
+struct fm_channel *fm_voicepool_keyon(struct fm_voicepool *pool, unsigned key,
+                                      unsigned blk, unsigned fnum);
+void fm_voicepool_keyoff(struct fm_voicepool *pool, unsigned key);
+// copies patch and publishes it for all voices without locking. the cost
+// does not depend on the voice count. call from one thread only, the
+// renderer may run concurrently.
+bool fm_voicepool_set_patch(struct fm_voicepool *pool, const struct fm_patch *patch);
+// renderer side: the patch live voices play, NULL before the first one was
+// taken. serial changes whenever the renderer takes a new patch.
+const struct fm_patch *fm_voicepool_patch(const struct fm_voicepool *pool, uint32_t *serial);
+// adds len samples to buf
+void fm_voicepool_render(struct fm_voicepool *pool, int32_t *buf, unsigned len);
+// keeps the first ms of output after up to entries distinct key ons from
+// silence, keyed by slot parameters, pitch and envelope phase. a repeated
+// note is copied from memory and handed over to synthesis with identical
+// output on key off, patch change or when the cached part runs out.
+// entries 0 disables. call from the renderer side, like key on.
+bool fm_voicepool_set_cache(struct fm_voicepool *pool, unsigned entries, unsigned ms);
+
+// voice state of a pool at one point, to render ahead and take it back
+struct fm_voicepool_snap {
+  struct fm_voice *voice;
+  uint16_t *live;
+  uint16_t *idle;
+  unsigned nlive;
+  unsigned nidle;
+  uint16_t keymap[FM_VOICE_KEYS];
+  uint32_t serial;
+  uint8_t env_div3;
+  // serial of the patch in use, 0 for none
+  uint32_t patch;
+  bool valid;
+};
+
+// sized for pool, which must not be reinitialized while snap is used
+bool fm_voicepool_snap_init(struct fm_voicepool_snap *snap, const struct fm_voicepool *pool);
+void fm_voicepool_snap_free(struct fm_voicepool_snap *snap);
+// false while the cache is enabled, cached voices cannot be taken back
+bool fm_voicepool_save(const struct fm_voicepool *pool, struct fm_voicepool_snap *snap);
+// false and pool unchanged if snap is not valid or the renderer took
+// another patch since it was saved. call from the renderer side.
+bool fm_voicepool_restore(struct fm_voicepool *pool, const struct fm_voicepool_snap *snap);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBOPNA_FMVOICE_H_INCLUDED */
@@ -0,0 +1,22 @@
+#ifndef LIBOPNA_FNUMTABLE_H_INCLUDED
+#define LIBOPNA_FNUMTABLE_H_INCLUDED
+
+#include <stdint.h>
+
+// fnum of each semitone from c, used with blk as the octave
+static const uint16_t fnumtable_fmp[] = {
+  0x026a, // c
+  0x028f, // c+
+  0x02b6, // d
+  0x02df, // d+
+  0x030b, // e
+  0x0339, // f
+  0x036a, // f+
+  0x039e, // g
+  0x03d5, // g+
+  0x0410, // a
+  0x044e, // a+
+  0x048f, // b
+};
+
+#endif /* LIBOPNA_FNUMTABLE_H_INCLUDED */
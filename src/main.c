@@ -1,31 +1,26 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <SDL.h>
 #include <SDL_stdinc.h>
 #include "font.h"
 #include "opnafm.h"
+#include "opnaprof.h"
+#include "rtsafe.h"
+#include "fft.h"
+#include "fmvoice.h"
+#include "opnabank.h"
+#include "fnumtable.h"
+#include "opnatrace.h"
 
 enum edit_state {
   STATE_DEFAULT,
   STATE_EDIT,
 };
 
-static const uint16_t fnumtable_fmp[] = {
-  0x026a, // c
-  0x028f, // c+
-  0x02b6, // d
-  0x02df, // d+
-  0x030b, // e
-  0x0339, // f
-  0x036a, // f+
-  0x039e, // g
-  0x03d5, // g+
-  0x0410, // a
-  0x044e, // a+
-  0x048f, // b
-};
-
 static struct {
   SDL_Window *mainwin;
   SDL_Renderer *renderer;
@@ -33,6 +28,18 @@ static struct {
   SDL_Texture *fonttex_neg;
   SDL_AudioDeviceID ad;
   uint8_t fontbuf[8*16*(16*6)];
+  // text grid: render() fills cell, text_flush() uploads what differs from shown
+#define TEXT_W 80
+#define TEXT_H 25
+#define TEXT_NEG 0x80
+  struct {
+    uint8_t cell[TEXT_H][TEXT_W];
+    uint8_t shown[TEXT_H][TEXT_W];
+    // streaming texture of the whole screen and its ARGB copy in memory,
+    // NULL when not supported: fall back to one copy per glyph
+    SDL_Texture *tex;
+    uint32_t *pixels;
+  } text;
   struct {
     int x;
     int y;
@@ -55,16 +62,117 @@ static struct {
       int dt;
     } slot[4];
   } param;
-  uint8_t env_div3;
 
-#define FM_CHAN_NUM 6
-  struct {
-    struct fm_channel chan;
-    bool keyon;
-    SDL_Scancode scancode;
-  } fmchan[FM_CHAN_NUM];
-  int next_chan;
+#define VOICE_NUM 128
+  // keyed by scancode
+  struct fm_voicepool pool;
+  unsigned voices;
+  // ms of each note kept by the voice pool cache, 0 for none
+  unsigned cache_ms;
   int octave;
+
+  // render-ahead mode: a separate thread keeps ring filled,
+  // audiocb only copies out of it
+  struct {
+    bool enabled;
+    // target fill in samples
+    unsigned depth;
+    SDL_Thread *thread;
+    // guards pool while the render thread owns synthesis
+    SDL_mutex *lock;
+    SDL_sem *wake;
+    SDL_atomic_t quit;
+    int16_t *ring;
+    // power of 2
+    unsigned size;
+    // free running sample counters
+    SDL_atomic_t rpos;
+    SDL_atomic_t wpos;
+    // device buffer, at most what one ahead_read takes
+    unsigned bufsamples;
+    // voice pool every AHEAD_SNAP samples of wpos, key events go back to
+    // the first one at least a device buffer past rpos. none with -C
+    struct {
+      struct fm_voicepool_snap pool;
+      unsigned pos;
+    } *snap;
+    unsigned nsnap;
+  } ahead;
+
+  // audiocb as a whole and synthesis alone, which differ in render-ahead mode
+  struct opna_prof prof_cb;
+  struct opna_prof prof_synth;
+
+  // current device buffer size
+  unsigned bufsamples;
+  // adaptive buffer sizing
+  struct {
+    bool enabled;
+    // profile when the device was opened
+    struct opna_prof_stats base;
+    Uint32 opened;
+  } adapt;
+
+  // key to sound latency test
+  struct {
+    bool enabled;
+    // set when a note was injected, cleared by audiocb on the first sound
+    SDL_atomic_t armed;
+    Uint64 detected;
+  } lat;
+
+  // real-time mode for the audio callback and render-ahead thread
+  struct {
+    bool enabled;
+    // -1: no pinning
+    int cpu;
+    // audio thread setup done, cleared when the device is reopened
+    bool cb_ready;
+  } rt;
+
+  // -b: F5/F6 step through the mapped bank, F4 stores the voice back
+  struct {
+    const char *path;
+    // -p: first voice to select
+    const char *select;
+    struct opna_bank bank;
+    // -1 while the voice is not from the bank
+    long cur;
+    char name[OPNA_BANK_NAMELEN+1];
+  } bank;
+
+  // oscilloscope and spectrum, fed by audiocb through a wait-free ring
+#define VIZ_RING 8192
+#define VIZ_FFT 1024
+  struct {
+    bool enabled;
+    // audiocb only writes here and advances wpos, never waits
+    int16_t ring[VIZ_RING];
+    SDL_atomic_t wpos;
+    struct fft fft;
+    float window[VIZ_FFT];
+    float re[VIZ_FFT];
+    float im[VIZ_FFT];
+  } viz;
+
+  // -t: voice pool actions to a trace file, see opnareplay
+  struct {
+    const char *path;
+    struct opna_trace_writer w;
+    bool enabled;
+    // samples synthesized so far, the clock of the trace
+    SDL_atomic_t pos;
+    // of the last patch traced, by the renderer when it takes one
+    uint32_t patch_serial;
+    // events are queued under the synth lock, which may be the audio
+    // callback, and written to the file by trace_drain on the main thread
+#define TRACE_RING 1024
+    struct opna_trace_event ring[TRACE_RING];
+    SDL_atomic_t wpos;
+    SDL_atomic_t rpos;
+    // events dropped on a full ring
+    unsigned lost;
+  } trace;
 } g;
 
 static void conv_font_raw(void) {
@@ -115,58 +223,470 @@ err:
   return false;
 }
 
-static void audiocb(void *userdata, Uint8 *stream, int len) {
-  (void)userdata;
-  int frames = len/2;
-  uint16_t *out = (uint16_t *)stream;
-  for (int i = 0; i < frames; i++) {
-    if (!g.env_div3) {
-      for (int c = 0; c < FM_CHAN_NUM; c++) {
-        fm_chanenv(&g.fmchan[c].chan);
+static void rt_setup(void) {
+  if (!g.rt.enabled) return;
+  if (!rt_thread_setup()) {
+    // no permission for SCHED_FIFO
+    SDL_SetThreadPriority(SDL_THREAD_PRIORITY_HIGH);
+  }
+  if (g.rt.cpu >= 0) rt_thread_pin(g.rt.cpu);
+}
+
+// under the synth lock, never blocks
+static void trace_push(const struct opna_trace_event *ev) {
+  unsigned wpos = SDL_AtomicGet(&g.trace.wpos);
+  if (wpos - SDL_AtomicGet(&g.trace.rpos) >= TRACE_RING) {
+    g.trace.lost++;
+    return;
+  }
+  g.trace.ring[wpos % TRACE_RING] = *ev;
+  SDL_MemoryBarrierRelease();
+  SDL_AtomicSet(&g.trace.wpos, wpos + 1);
+}
+
+// main thread, the file i/o of the trace happens here
+static void trace_drain(void) {
+  unsigned rpos = SDL_AtomicGet(&g.trace.rpos);
+  unsigned wpos = SDL_AtomicGet(&g.trace.wpos);
+  SDL_MemoryBarrierAcquire();
+  for (; rpos != wpos; rpos++) {
+    const struct opna_trace_event *ev = &g.trace.ring[rpos % TRACE_RING];
+    switch (ev->type) {
+    case OPNA_TRACE_KEYON:
+      opna_trace_keyon(&g.trace.w, ev->sample, ev->key, ev->blk, ev->fnum);
+      break;
+    case OPNA_TRACE_KEYOFF:
+      opna_trace_keyoff(&g.trace.w, ev->sample, ev->key);
+      break;
+    case OPNA_TRACE_PATCH:
+      opna_trace_patch(&g.trace.w, ev->sample, &ev->patch);
+      break;
+    }
+  }
+  SDL_MemoryBarrierRelease();
+  SDL_AtomicSet(&g.trace.rpos, rpos);
+}
+
+// a patch is heard from the block where the renderer takes it, which is
+// the point to trace it at
+static void trace_taken_patch(unsigned offset) {
+  uint32_t serial;
+  const struct fm_patch *patch = fm_voicepool_patch(&g.pool, &serial);
+  if (!patch || serial == g.trace.patch_serial) return;
+  g.trace.patch_serial = serial;
+  struct opna_trace_event ev = {0};
+  ev.sample = (uint32_t)(SDL_AtomicGet(&g.trace.pos) + offset);
+  ev.type = OPNA_TRACE_PATCH;
+  ev.patch = *patch;
+  trace_push(&ev);
+}
+
+static void synth(int16_t *out, int frames) {
+  uint64_t start = opna_prof_now();
+  int32_t buf[256];
+  for (int done = 0; done < frames;) {
+    int len = frames - done;
+    if (len > 256) len = 256;
+    for (int i = 0; i < len; i++) buf[i] = 0;
+    fm_voicepool_render(&g.pool, buf, len);
+    if (g.trace.enabled) trace_taken_patch(done);
+    for (int i = 0; i < len; i++) {
+      int32_t sample = buf[i] / 2;
+      if (sample > INT16_MAX) sample = INT16_MAX;
+      if (sample < INT16_MIN) sample = INT16_MIN;
+      out[done+i] = sample;
+    }
+    done += len;
+  }
+  if (g.trace.enabled) SDL_AtomicAdd(&g.trace.pos, frames);
+  opna_prof_record(&g.prof_synth, opna_prof_now() - start, frames, 55467);
+}
+
+// copy out of the ring, no locks and no synthesis here
+static void ahead_read(int16_t *out, int frames) {
+  unsigned rpos = SDL_AtomicGet(&g.ahead.rpos);
+  unsigned wpos = SDL_AtomicGet(&g.ahead.wpos);
+  SDL_MemoryBarrierAcquire();
+  // wpos is behind rpos for a moment when ahead_rewind loses the race
+  unsigned avail = (int)(wpos - rpos) > 0 ? wpos - rpos : 0;
+  unsigned len = (unsigned)frames < avail ? (unsigned)frames : avail;
+  unsigned mask = g.ahead.size - 1;
+  for (unsigned i = 0; i < len; i++) {
+    out[i] = g.ahead.ring[(rpos+i) & mask];
+  }
+  // underrun
+  for (int i = len; i < frames; i++) {
+    out[i] = 0;
+  }
+  SDL_MemoryBarrierRelease();
+  SDL_AtomicSet(&g.ahead.rpos, rpos + len);
+}
+
+// spacing of voice pool snapshots in render-ahead mode
+#define AHEAD_SNAP 256
+
+static int ahead_thread(void *ptr) {
+  (void)ptr;
+  rt_setup();
+  // wake up often enough to refill before the device drains a quarter of depth
+  Uint32 timeout = g.ahead.depth * 1000 / 4 / 55467;
+  if (!timeout) timeout = 1;
+  unsigned mask = g.ahead.size - 1;
+  while (!SDL_AtomicGet(&g.ahead.quit)) {
+    SDL_LockMutex(g.ahead.lock);
+    for (;;) {
+      unsigned rpos = SDL_AtomicGet(&g.ahead.rpos);
+      unsigned wpos = SDL_AtomicGet(&g.ahead.wpos);
+      if ((int)(wpos - rpos) < 0) {
+        // the callback played past a rewind, continue from where it is
+        wpos = rpos;
+        SDL_AtomicSet(&g.ahead.wpos, wpos);
+      }
+      unsigned fill = wpos - rpos;
+      if (fill >= g.ahead.depth) break;
+      // small chunks so that key events land in the next chunk
+      unsigned len = g.ahead.depth - fill;
+      if (len > 64) len = 64;
+      unsigned contig = g.ahead.size - (wpos & mask);
+      if (len > contig) len = contig;
+      unsigned snapleft = AHEAD_SNAP - wpos % AHEAD_SNAP;
+      if (len > snapleft) len = snapleft;
+      if (g.ahead.nsnap && !(wpos % AHEAD_SNAP)) {
+        unsigned i = wpos / AHEAD_SNAP % g.ahead.nsnap;
+        fm_voicepool_save(&g.pool, &g.ahead.snap[i].pool);
+        g.ahead.snap[i].pos = wpos;
       }
-      g.env_div3 = 3;
+      synth(g.ahead.ring + (wpos & mask), len);
+      SDL_MemoryBarrierRelease();
+      SDL_AtomicSet(&g.ahead.wpos, wpos + len);
+    }
+    SDL_UnlockMutex(g.ahead.lock);
+    SDL_SemWaitTimeout(g.ahead.wake, timeout);
+  }
+  return 0;
+}
+
+static void free_ahead_snap(void) {
+  for (unsigned i = 0; i < g.ahead.nsnap; i++) fm_voicepool_snap_free(&g.ahead.snap[i].pool);
+  SDL_free(g.ahead.snap);
+  g.ahead.snap = 0;
+  g.ahead.nsnap = 0;
+}
+
+// a snapshot at least one device buffer past rpos while wpos is depth ahead
+static bool alloc_ahead_snap(void) {
+  unsigned n = (g.ahead.depth + 63) / AHEAD_SNAP + 2;
+  g.ahead.snap = SDL_calloc(n, sizeof(*g.ahead.snap));
+  if (!g.ahead.snap) return false;
+  for (; g.ahead.nsnap < n; g.ahead.nsnap++) {
+    if (!fm_voicepool_snap_init(&g.ahead.snap[g.ahead.nsnap].pool, &g.pool)) {
+      free_ahead_snap();
+      return false;
     }
-    g.env_div3--;
-    int32_t sample = 0;
-    for (int c = 0; c < FM_CHAN_NUM; c++) {
-      sample += fm_chanout(&g.fmchan[c].chan);
-      fm_chanphase(&g.fmchan[c].chan);
+    if (g.rt.enabled) {
+      rt_prefault(g.ahead.snap[g.ahead.nsnap].pool.voice, sizeof(*g.pool.voice) * g.pool.count);
     }
-    sample /= 2;
-    if (sample > INT16_MAX) sample = INT16_MAX;
-    if (sample < INT16_MIN) sample = INT16_MIN;
-    out[i] = sample;
   }
+  return true;
+}
+
+static bool start_ahead(unsigned bufsamples) {
+  unsigned size = 1;
+  while (size < g.ahead.depth + bufsamples) size <<= 1;
+  g.ahead.size = size;
+  g.ahead.bufsamples = bufsamples;
+  g.ahead.ring = SDL_calloc(size, sizeof(int16_t));
+  if (!g.ahead.ring) goto err;
+  if (g.rt.enabled) rt_prefault(g.ahead.ring, size * sizeof(int16_t));
+  // cached voices cannot be taken back, key events stay at wpos
+  if (!g.cache_ms && !alloc_ahead_snap()) goto err_ring;
+  g.ahead.lock = SDL_CreateMutex();
+  if (!g.ahead.lock) goto err_snap;
+  g.ahead.wake = SDL_CreateSemaphore(0);
+  if (!g.ahead.wake) goto err_lock;
+  SDL_AtomicSet(&g.ahead.quit, 0);
+  SDL_AtomicSet(&g.ahead.rpos, 0);
+  SDL_AtomicSet(&g.ahead.wpos, 0);
+  g.ahead.thread = SDL_CreateThread(ahead_thread, "render-ahead", 0);
+  if (!g.ahead.thread) goto err_wake;
+  return true;
+
+err_wake:
+  SDL_DestroySemaphore(g.ahead.wake);
+err_lock:
+  SDL_DestroyMutex(g.ahead.lock);
+err_snap:
+  free_ahead_snap();
+err_ring:
+  SDL_free(g.ahead.ring);
+err:
+  g.ahead.enabled = false;
+  return false;
+}
+
+static void stop_ahead(void) {
+  if (!g.ahead.thread) return;
+  SDL_AtomicSet(&g.ahead.quit, 1);
+  SDL_SemPost(g.ahead.wake);
+  SDL_WaitThread(g.ahead.thread, 0);
+  g.ahead.thread = 0;
+  SDL_DestroySemaphore(g.ahead.wake);
+  SDL_DestroyMutex(g.ahead.lock);
+  free_ahead_snap();
+  SDL_free(g.ahead.ring);
+}
+
+// render-ahead mode, under the lock: the samples past the first snapshot
+// at least a device buffer after rpos are rendered again with the key
+// event in them. the callback may be copying up to a buffer past rpos,
+// nothing after that has been handed out. the key is heard within
+// bufsamples + AHEAD_SNAP samples whatever the depth, or after depth + 64
+// when there is no snapshot: with -C, after a patch change, or before the
+// ring has one past the previous key event.
+static void ahead_rewind(void) {
+  unsigned rpos = SDL_AtomicGet(&g.ahead.rpos);
+  unsigned wpos = SDL_AtomicGet(&g.ahead.wpos);
+  unsigned from = rpos + g.ahead.bufsamples;
+  int best = -1;
+  for (unsigned i = 0; i < g.ahead.nsnap; i++) {
+    if (!g.ahead.snap[i].pool.valid) continue;
+    unsigned pos = g.ahead.snap[i].pos;
+    if ((int)(pos - from) < 0 || (int)(wpos - pos) <= 0) continue;
+    if (best < 0 || (int)(pos - g.ahead.snap[best].pos) < 0) best = i;
+  }
+  if (best >= 0 && fm_voicepool_restore(&g.pool, &g.ahead.snap[best].pool)) {
+    unsigned pos = g.ahead.snap[best].pos;
+    SDL_AtomicAdd(&g.trace.pos, -(int)(wpos - pos));
+    SDL_AtomicSet(&g.ahead.wpos, pos);
+    // the callback does not take the lock and may have passed pos if this
+    // thread was held up for longer than a device period since rpos was read
+    rpos = SDL_AtomicGet(&g.ahead.rpos);
+    if ((int)(rpos - pos) > 0) SDL_AtomicSet(&g.ahead.wpos, rpos);
+  }
+  // all of them are from before the key event
+  for (unsigned i = 0; i < g.ahead.nsnap; i++) g.ahead.snap[i].pool.valid = false;
 }
 
-static bool openaudio(void) {
-  for (int i = 0; i < FM_CHAN_NUM; i++) {
-    fm_chan_reset(&g.fmchan[i].chan);
+static void lock_synth(void) {
+  if (g.ahead.enabled) SDL_LockMutex(g.ahead.lock);
+  else SDL_LockAudioDevice(g.ad);
+}
+
+static void unlock_synth(void) {
+  if (g.ahead.enabled) SDL_UnlockMutex(g.ahead.lock);
+  else SDL_UnlockAudioDevice(g.ad);
+}
+
+static void viz_publish(const int16_t *out, int frames) {
+  unsigned wpos = SDL_AtomicGet(&g.viz.wpos);
+  unsigned offset = wpos & (VIZ_RING-1);
+  if ((unsigned)frames > VIZ_RING) {
+    out += frames - VIZ_RING;
+    frames = VIZ_RING;
+  }
+  unsigned first = VIZ_RING - offset;
+  if (first > (unsigned)frames) first = frames;
+  SDL_memcpy(g.viz.ring + offset, out, first * sizeof(int16_t));
+  SDL_memcpy(g.viz.ring, out + first, (frames - first) * sizeof(int16_t));
+  SDL_MemoryBarrierRelease();
+  SDL_AtomicSet(&g.viz.wpos, wpos + frames);
+}
+
+static void audiocb(void *userdata, Uint8 *stream, int len) {
+  (void)userdata;
+  int frames = len/2;
+  int16_t *out = (int16_t *)stream;
+  if (!g.rt.cb_ready) {
+    rt_setup();
+    g.rt.cb_ready = true;
   }
+  rt_check_enter();
+  uint64_t start = opna_prof_now();
+  Uint64 now = g.lat.enabled ? SDL_GetPerformanceCounter() : 0;
+  if (g.ahead.enabled) ahead_read(out, frames);
+  else synth(out, frames);
+  opna_prof_record(&g.prof_cb, opna_prof_now() - start, frames, 55467);
+  if (g.viz.enabled) viz_publish(out, frames);
+  if (g.lat.enabled && SDL_AtomicGet(&g.lat.armed)) {
+    for (int i = 0; i < frames; i++) {
+      if (!out[i]) continue;
+      // when the sample is handed to the device
+      g.lat.detected = now + SDL_GetPerformanceFrequency() * i / 55467;
+      SDL_MemoryBarrierRelease();
+      SDL_AtomicSet(&g.lat.armed, 0);
+      break;
+    }
+  }
+  rt_check_leave();
+}
+
+// adaptive mode starts here and takes the smallest buffer whose period is
+// ADAPT_MARGIN times the slowest render seen
+#define ADAPT_MIN_SAMPLES 128
+#define ADAPT_MAX_SAMPLES 8192
+#define ADAPT_MARGIN 2
+// halves the buffer after this long with twice the margin to spare
+#define ADAPT_SHRINK_MS 5000
+
+static struct opna_prof *adapt_prof(void) {
+  // in render-ahead mode the callback only copies, the thread does the work
+  return g.ahead.enabled ? &g.prof_synth : &g.prof_cb;
+}
 
+static bool openaudio(unsigned samples) {
   SDL_AudioSpec as = {0};
   as.freq = 55467;
   as.format = AUDIO_S16SYS;
   as.channels = 1;
-  as.samples = 1024;
+  as.samples = samples;
   as.callback = audiocb;
   SDL_AudioDeviceID ad = SDL_OpenAudioDevice(0, 0, &as, 0, 0);
   if (!ad) return false;
   
   g.ad = ad;
+  g.bufsamples = samples;
+  g.rt.cb_ready = false;
+  if (g.ahead.enabled && !start_ahead(as.samples)) {
+    SDL_CloseAudioDevice(ad);
+    g.ad = 0;
+    return false;
+  }
+  opna_prof_get(adapt_prof(), &g.adapt.base);
+  g.adapt.opened = SDL_GetTicks();
+  return true;
+}
+
+// channel state lives in g and survives the reopen
+static bool reopenaudio(unsigned samples) {
+  if (g.ad) SDL_CloseAudioDevice(g.ad);
+  stop_ahead();
+  g.ad = 0;
+  if (!openaudio(samples)) return false;
+  SDL_PauseAudioDevice(g.ad, 0);
+  return true;
+}
+
+static double adapt_period_ns(unsigned samples) {
+  return samples * 1e9 / 55467;
+}
+
+// called periodically from the event loop
+static void adapt_audio(void) {
+  if (!g.adapt.enabled) return;
+  struct opna_prof_stats now;
+  opna_prof_get(adapt_prof(), &now);
+  uint64_t samples = now.samples - g.adapt.base.samples;
+  if (!samples) return;
+  // slowest call since the device was opened: the top of its time bucket,
+  // or the all time maximum if that is lower
+  int bucket = -1;
+  for (int i = 0; i < OPNA_PROF_TIME_BUCKETS; i++) {
+    if (now.time_hist[i] != g.adapt.base.time_hist[i]) bucket = i;
+  }
+  if (bucket < 0) return;
+  uint64_t worst = (uint64_t)2 << bucket;
+  if (now.max_ns < worst) worst = now.max_ns;
+  double per_sample = (double)(now.total_ns - g.adapt.base.total_ns) / samples;
+
+  // a larger buffer also renders more samples per call
+  unsigned want = ADAPT_MIN_SAMPLES;
+  while (want < ADAPT_MAX_SAMPLES) {
+    double cost = worst;
+    if (want > g.bufsamples) cost += (want - g.bufsamples) * per_sample;
+    if (adapt_period_ns(want) >= ADAPT_MARGIN * cost) break;
+    want *= 2;
+  }
+  if (want < g.bufsamples) {
+    // one step at a time, only after a quiet while
+    if (SDL_GetTicks() - g.adapt.opened < ADAPT_SHRINK_MS) return;
+    if (adapt_period_ns(g.bufsamples / 2) < 2 * ADAPT_MARGIN * (double)worst) return;
+    want = g.bufsamples / 2;
+  }
+  if (want == g.bufsamples) return;
+  if (!reopenaudio(want)) {
+    // fall back to the fixed default
+    if (!reopenaudio(1024)) return;
+    g.adapt.enabled = false;
+  }
+}
+
+static bool create_texttex(void) {
+  g.text.pixels = SDL_malloc(sizeof(uint32_t) * TEXT_W*8 * TEXT_H*16);
+  if (!g.text.pixels) return false;
+  g.text.tex = SDL_CreateTexture(g.renderer, SDL_PIXELFORMAT_ARGB8888,
+                                 SDL_TEXTUREACCESS_STREAMING,
+                                 TEXT_W*8, TEXT_H*16);
+  if (!g.text.tex) {
+    SDL_free(g.text.pixels);
+    g.text.pixels = 0;
+    return false;
+  }
+  // force the first flush to upload everything
+  SDL_memset(g.text.shown, 0, sizeof(g.text.shown));
   return true;
 }
 
+static void text_clear(void) {
+  SDL_memset(g.text.cell, ' ', sizeof(g.text.cell));
+}
+
+static void text_drawcell(int y, int x, uint8_t cell) {
+  const uint8_t *glyph = &g.fontbuf[((cell & ~TEXT_NEG)-0x20)*16*8];
+  uint32_t fg = (cell & TEXT_NEG) ? 0xff000000 : 0xffffffff;
+  uint32_t bg = (cell & TEXT_NEG) ? 0xffffffff : 0xff000000;
+  uint32_t *dst = g.text.pixels + (y*16)*(TEXT_W*8) + x*8;
+  for (int gy = 0; gy < 16; gy++) {
+    for (int gx = 0; gx < 8; gx++) {
+      dst[gx] = glyph[gy*8+gx] ? fg : bg;
+    }
+    dst += TEXT_W*8;
+  }
+}
+
+// one texture update per row with changes, one copy for the whole screen
+static void text_flush(void) {
+  if (!g.text.tex) {
+    SDL_RenderClear(g.renderer);
+    for (int y = 0; y < TEXT_H; y++) {
+      for (int x = 0; x < TEXT_W; x++) {
+        uint8_t cell = g.text.cell[y][x];
+        if (cell == ' ') continue;
+        SDL_Rect srcrect = {
+          0, ((cell & ~TEXT_NEG)-0x20)*16, 8, 16
+        };
+        SDL_Rect dstrect = {
+          x*8, y*16, 8, 16
+        };
+        SDL_Texture *tex = (cell & TEXT_NEG) ? g.fonttex_neg : g.fonttex;
+        SDL_RenderCopy(g.renderer, tex, &srcrect, &dstrect);
+      }
+    }
+    return;
+  }
+  for (int y = 0; y < TEXT_H; y++) {
+    int x0 = TEXT_W, x1 = -1;
+    for (int x = 0; x < TEXT_W; x++) {
+      if (g.text.cell[y][x] == g.text.shown[y][x]) continue;
+      text_drawcell(y, x, g.text.cell[y][x]);
+      g.text.shown[y][x] = g.text.cell[y][x];
+      if (x < x0) x0 = x;
+      x1 = x;
+    }
+    if (x1 < 0) continue;
+    SDL_Rect rect = {
+      x0*8, y*16, (x1-x0+1)*8, 16
+    };
+    SDL_UpdateTexture(g.text.tex, &rect,
+                      g.text.pixels + rect.y*(TEXT_W*8) + rect.x,
+                      TEXT_W*8*sizeof(uint32_t));
+  }
+  SDL_RenderCopy(g.renderer, g.text.tex, 0, 0);
+}
+
 static void cmvputchr(bool color, int y, int x, char c) {
   if (c < 0x20 || c >= 0x80) return;
-  SDL_Rect srcrect = {
-    0, (c-0x20)*16, 8, 16
-  };
-  SDL_Rect dstrect = {
-    x*8, y*16, 8, 16
-  };
-  SDL_Texture *tex = color ? g.fonttex_neg : g.fonttex;
-  SDL_RenderCopy(g.renderer, tex, &srcrect, &dstrect);
+  if (y < 0 || y >= TEXT_H || x < 0 || x >= TEXT_W) return;
+  g.text.cell[y][x] = c | (color ? TEXT_NEG : 0);
 }
 
 static void cmvputsr(bool color, int y, int x, const char *text) {
@@ -186,6 +706,75 @@ static void cmvprintr(bool color, int y, int x, const char *format, ...) {
   cmvputsr(color, y, x, buf);
 }
 
+static void render_prof(int y) {
+  struct opna_prof_stats cb, sy;
+  opna_prof_get(&g.prof_cb, &cb);
+  opna_prof_get(&g.prof_synth, &sy);
+  cmvprintr(false, y, 0, "cb p99:%3d%% max:%3d%% xrun:%-6d synth:%5dns/smp p99:%5dus buf:%d",
+            (int)(opna_prof_ratio_quantile(&cb, 0.99)*100),
+            (int)(opna_prof_ratio_quantile(&cb, 1.0)*100),
+            (int)cb.overruns,
+            (int)opna_prof_ns_per_sample(&sy),
+            (int)(opna_prof_time_quantile(&sy, 0.99) / 1000),
+            g.bufsamples);
+}
+
+static bool viz_init(void) {
+  if (!fft_init(&g.viz.fft, VIZ_FFT)) return false;
+  for (int i = 0; i < VIZ_FFT; i++) {
+    // hann
+    g.viz.window[i] = 0.5f - 0.5f * SDL_cosf(2.0f * (float)M_PI * i / (VIZ_FFT-1));
+  }
+  return true;
+}
+
+// copy the latest n samples, false if the writer lapped us meanwhile
+static bool viz_fetch(float *dst, unsigned n) {
+  unsigned wpos = SDL_AtomicGet(&g.viz.wpos);
+  SDL_MemoryBarrierAcquire();
+  for (unsigned i = 0; i < n; i++) {
+    dst[i] = g.viz.ring[(wpos - n + i) & (VIZ_RING-1)] / 32768.0f;
+  }
+  SDL_MemoryBarrierAcquire();
+  unsigned now = SDL_AtomicGet(&g.viz.wpos);
+  return now - wpos <= VIZ_RING - n;
+}
+
+// rows 14-23: scope on the left half, spectrum on the right half
+static void render_viz(void) {
+  const int top = 14*16, height = 10*16, width = TEXT_W*8/2;
+  SDL_Point pts[TEXT_W*8/2];
+  if (!viz_fetch(g.viz.re, VIZ_FFT)) return;
+
+  SDL_SetRenderDrawColor(g.renderer, 0, 255, 0, 255);
+  // newest width*2 samples, every other one
+  for (int x = 0; x < width; x++) {
+    float v = g.viz.re[VIZ_FFT - width*2 + x*2];
+    pts[x].x = x;
+    pts[x].y = top + height/2 - (int)(v * (height/2));
+  }
+  SDL_RenderDrawLines(g.renderer, pts, width);
+
+  for (int i = 0; i < VIZ_FFT; i++) {
+    g.viz.re[i] *= g.viz.window[i];
+    g.viz.im[i] = 0.0f;
+  }
+  fft_run(&g.viz.fft, g.viz.re, g.viz.im);
+  // 0 to -80dB over the height, bins linear up to nyquist
+  for (int x = 0; x < width; x++) {
+    int bin = 1 + x * (VIZ_FFT/2-1) / width;
+    float p = g.viz.re[bin]*g.viz.re[bin] + g.viz.im[bin]*g.viz.im[bin];
+    float db = 10.0f * SDL_log10f(p / (VIZ_FFT*VIZ_FFT/16) + 1e-12f);
+    if (db < -80.0f) db = -80.0f;
+    if (db > 0.0f) db = 0.0f;
+    pts[x].x = width + x;
+    pts[x].y = top + (int)(-db * height / 80.0f);
+  }
+  SDL_SetRenderDrawColor(g.renderer, 255, 255, 0, 255);
+  SDL_RenderDrawLines(g.renderer, pts, width);
+  SDL_SetRenderDrawColor(g.renderer, 0, 0, 0, 0);
+}
+
 static int getval(void) {
   if (g.pos.y == 0) {
     if (g.pos.x == 1) return g.param.alg;
@@ -211,91 +800,141 @@ static int getval(void) {
     } \
   } while (0)
 
+static void param_to_patch(struct fm_patch *patch) {
+  patch->alg = g.param.alg;
+  patch->fb = g.param.fbl;
+  for (int s = 0; s < 4; s++) {
+    patch->slot[s].ar = g.param.slot[s].ar;
+    patch->slot[s].dr = g.param.slot[s].dr;
+    patch->slot[s].sr = g.param.slot[s].sr;
+    patch->slot[s].rr = g.param.slot[s].rr;
+    patch->slot[s].sl = g.param.slot[s].sl;
+    patch->slot[s].tl = g.param.slot[s].tl;
+    patch->slot[s].ks = g.param.slot[s].ks;
+    patch->slot[s].mul = g.param.slot[s].ml;
+    patch->slot[s].det = g.param.slot[s].dt;
+  }
+}
+
+// no lock, the renderer picks the new patch up at its next block and
+// traces it there
+static void set_patch(const struct fm_patch *patch) {
+  fm_voicepool_set_patch(&g.pool, patch);
+}
+
+static void publish_patch(void) {
+  struct fm_patch patch;
+  param_to_patch(&patch);
+  set_patch(&patch);
+}
+
+static void patch_to_param(const struct fm_patch *patch) {
+  g.param.alg = patch->alg;
+  g.param.fbl = patch->fb;
+  for (int s = 0; s < 4; s++) {
+    g.param.slot[s].ar = patch->slot[s].ar;
+    g.param.slot[s].dr = patch->slot[s].dr;
+    g.param.slot[s].sr = patch->slot[s].sr;
+    g.param.slot[s].rr = patch->slot[s].rr;
+    g.param.slot[s].sl = patch->slot[s].sl;
+    g.param.slot[s].tl = patch->slot[s].tl;
+    g.param.slot[s].ks = patch->slot[s].ks;
+    g.param.slot[s].ml = patch->slot[s].mul;
+    g.param.slot[s].dt = patch->slot[s].det;
+  }
+}
+
+// O(1), publishes the mapped patch as is
+static void bank_select(long i) {
+  if (i < 0 || i >= (long)g.bank.bank.count) return;
+  const struct opna_bankpatch *bp = &g.bank.bank.patch[i];
+  g.bank.cur = i;
+  memcpy(g.bank.name, bp->name, OPNA_BANK_NAMELEN);
+  g.bank.name[OPNA_BANK_NAMELEN] = 0;
+  patch_to_param(&bp->patch);
+  set_patch(&bp->patch);
+}
+
+// rewrites the bank with the current voice replacing the selected one,
+// or appended when none is selected
+static bool bank_store(void) {
+  if (!g.bank.path) return false;
+  uint32_t count = g.bank.bank.count;
+  long cur = g.bank.cur;
+  if (cur < 0) cur = count++;
+  struct opna_bankpatch *patches = malloc(sizeof(*patches) * count);
+  if (!patches) return false;
+  if (g.bank.bank.count) {
+    memcpy(patches, g.bank.bank.patch, sizeof(*patches) * g.bank.bank.count);
+  }
+  if (!g.bank.name[0]) snprintf(g.bank.name, sizeof(g.bank.name), "voice%05ld", cur);
+  struct fm_patch patch;
+  param_to_patch(&patch);
+  opna_bankpatch_set(&patches[cur], g.bank.name, &patch);
+  // patches is a copy, the old mapping stays usable until the new file is in place
+  bool ok = opna_bank_save(g.bank.path, patches, count, &g.bank.bank);
+  free(patches);
+  if (!ok) {
+    // the file is unchanged, reopen it if the save had to close it
+    if (!g.bank.bank.map) opna_bank_open(&g.bank.bank, g.bank.path);
+    return false;
+  }
+  opna_bank_close(&g.bank.bank);
+  if (!opna_bank_open(&g.bank.bank, g.bank.path)) return false;
+  g.bank.cur = cur;
+  return true;
+}
+
 static void setval(int v) {
-  SDL_LockAudioDevice(g.ad);
   if (v < 0) v = 0;
   if (g.pos.y == 0) {
     if (g.pos.x == 1) {
       R(7);
       g.param.alg = v;
-      for (int i = 0; i < FM_CHAN_NUM; i++) {
-        fm_chan_set_alg(&g.fmchan[i].chan, v);
-      }
     }
     if (g.pos.x == 2) {
       R(7);
       g.param.fbl = v;
-      for (int i = 0; i < FM_CHAN_NUM; i++) {
-        fm_chan_set_fb(&g.fmchan[i].chan, v);
-      }
     }
   } else {
-    int slotnum = g.pos.y - 1;
     if (g.pos.x == 0) {
       R(31);
       g.param.slot[g.pos.y-1].ar = v;
-      for (int i = 0; i < FM_CHAN_NUM; i++) {
-        fm_slot_set_ar(&g.fmchan[i].chan.slot[slotnum], v);
-      }
     }
     if (g.pos.x == 1) {
       R(31);
       g.param.slot[g.pos.y-1].dr = v;
-      for (int i = 0; i < FM_CHAN_NUM; i++) {
-        fm_slot_set_dr(&g.fmchan[i].chan.slot[slotnum], v);
-      }
     }
     if (g.pos.x == 2) {
       R(31);
       g.param.slot[g.pos.y-1].sr = v;
-      for (int i = 0; i < FM_CHAN_NUM; i++) {
-        fm_slot_set_sr(&g.fmchan[i].chan.slot[slotnum], v);
-      }
     }
     if (g.pos.x == 3) {
       R(15);
       g.param.slot[g.pos.y-1].rr = v;
-      for (int i = 0; i < FM_CHAN_NUM; i++) {
-        fm_slot_set_rr(&g.fmchan[i].chan.slot[slotnum], v);
-      }
     }
     if (g.pos.x == 4) {
       R(15);
       g.param.slot[g.pos.y-1].sl = v;
-      for (int i = 0; i < FM_CHAN_NUM; i++) {
-        fm_slot_set_sl(&g.fmchan[i].chan.slot[slotnum], v);
-      }
     }
     if (g.pos.x == 5) {
       R(127);
       g.param.slot[g.pos.y-1].tl = v;
-      for (int i = 0; i < FM_CHAN_NUM; i++) {
-        fm_slot_set_tl(&g.fmchan[i].chan.slot[slotnum], v);
-      }
     }
     if (g.pos.x == 6) {
       R(3);
       g.param.slot[g.pos.y-1].ks = v;
-      for (int i = 0; i < FM_CHAN_NUM; i++) {
-        fm_slot_set_ks(&g.fmchan[i].chan.slot[slotnum], v);
-      }
     }
     if (g.pos.x == 7) {
       R(15);
       g.param.slot[g.pos.y-1].ml = v;
-      for (int i = 0; i < FM_CHAN_NUM; i++) {
-        fm_slot_set_mul(&g.fmchan[i].chan.slot[slotnum], v);
-      }
     }
     if (g.pos.x == 8) {
       R(7);
       g.param.slot[g.pos.y-1].dt = v;
-      for (int i = 0; i < FM_CHAN_NUM; i++) {
-        fm_slot_set_det(&g.fmchan[i].chan.slot[slotnum], v);
-      }
     }
   }
-  SDL_UnlockAudioDevice(g.ad);
+  publish_patch();
 }
 
 #undef R
@@ -309,12 +948,13 @@ static void parse_and_set(void) {
 }
 
 static void render(void) {
-  SDL_RenderClear(g.renderer);
+  text_clear();
   cmvprintr(false, 0,  0, "[[[ OPN Voice Editor ver.0.1 ]]]  2016.08.05");
   cmvprintr(false, 1,  0, "Renderer: %s", g.ri.name);
   cmvprintr(false, 2,  0, "=================== Edit Area ===================  =========== Usage ===========");
   cmvprintr(false, 3,  0, "                                                   ---------");
-  cmvprintr(false, 4,  0, "      NUM ALG FBL   Name: abcdefg     Octave: %03d", g.octave);
+  cmvprintr(false, 4,  0, "      NUM ALG FBL   Name: %-12.12s  Octave: %03d",
+            g.bank.name[0] ? g.bank.name : "(none)", g.octave);
   cmvprintr(false, 6,  0, "       AR  DR  SR  RR  SL  TL  KS  ML DT1 DT2 AME");
   cmvprintr(false, 13, 0, "=================== Push Area ===================");
   for (int i = 0; i < 4; i++) {
@@ -355,31 +995,12 @@ static void render(void) {
       }
     }
   }
+  render_prof(24);
+  text_flush();
+  if (g.viz.enabled) render_viz();
   SDL_RenderPresent(g.renderer);
 }
 
-static int allocate_channel(SDL_Scancode scancode) {
-  for (int i = 0; i < FM_CHAN_NUM; i++) {
-    int index = (i + g.next_chan) % FM_CHAN_NUM;
-    if (g.fmchan[index].keyon) continue;
-    g.fmchan[index].keyon = true;
-    g.fmchan[index].scancode = scancode;
-    g.next_chan = (index+1) % FM_CHAN_NUM;
-    return index;
-  }
-  return -1;
-}
-
-static int search_channel(SDL_Scancode scancode) {
-  for (int i = 0; i < FM_CHAN_NUM; i++) {
-    if (!g.fmchan[i].keyon) continue;
-    if (g.fmchan[i].scancode != scancode) continue;
-    g.fmchan[i].keyon = false;
-    return i;
-  }
-  return -1;
-}
-
 static void handle_key_tone(const SDL_KeyboardEvent *ke) {
   int blk = g.octave;
   unsigned fnum;
@@ -458,23 +1079,28 @@ static void handle_key_tone(const SDL_KeyboardEvent *ke) {
   }
   // ignore key repeat
   if (ke->repeat) return;
-  int chan;
-  bool keyon = (ke->state == SDL_PRESSED);
-  if (keyon) chan = allocate_channel(ke->keysym.scancode);
-  else chan = search_channel(ke->keysym.scancode);
-  if (chan == -1) return;
-
   if (blk < 0) blk = 0;
   if (blk > 7) blk = 7;
 
-  SDL_LockAudioDevice(g.ad);
-  if (keyon) {
-    fm_chan_set_blkfnum(&g.fmchan[chan].chan, blk, fnum);
-  }
-  for (int i = 0; i < 4; i++) {
-    fm_slot_key(&g.fmchan[chan].chan, i, keyon);
+  lock_synth();
+  if (g.ahead.enabled) ahead_rewind();
+  // under the lock the trace clock is exactly where the key takes effect
+  struct opna_trace_event ev = {0};
+  ev.sample = (uint32_t)SDL_AtomicGet(&g.trace.pos);
+  ev.key = ke->keysym.scancode;
+  if (ke->state == SDL_PRESSED) {
+    fm_voicepool_keyon(&g.pool, ke->keysym.scancode, blk, fnum);
+    ev.type = OPNA_TRACE_KEYON;
+    ev.blk = blk;
+    ev.fnum = fnum;
+  } else {
+    fm_voicepool_keyoff(&g.pool, ke->keysym.scancode);
+    ev.type = OPNA_TRACE_KEYOFF;
   }
-  SDL_UnlockAudioDevice(g.ad);
+  if (g.trace.enabled) trace_push(&ev);
+  unlock_synth();
+  // render the key change right away instead of at the next timeout
+  if (g.ahead.enabled) SDL_SemPost(g.ahead.wake);
 }
 
 static void handle_key(const SDL_KeyboardEvent *ke) {
@@ -704,23 +1330,257 @@ static void handle_key(const SDL_KeyboardEvent *ke) {
       if (g.octave < 0) g.octave = 0;
       render();
       break;
+    case SDLK_F2:
+      if (g.viz.fft.n) g.viz.enabled = !g.viz.enabled;
+      render();
+      break;
+    case SDLK_F4:
+      if (!bank_store()) fprintf(stderr, "failed to store voice in %s\n", g.bank.path);
+      render();
+      break;
+    case SDLK_F5:
+      bank_select(g.bank.cur - 1);
+      render();
+      break;
+    case SDLK_F6:
+      bank_select(g.bank.cur + 1);
+      render();
+      break;
     default:
       break;
     }
   }
 }
 
+#define LAT_TRIALS 100
+
+static int lat_cmp(const void *a, const void *b) {
+  double da = *(const double *)a, db = *(const double *)b;
+  return (da > db) - (da < db);
+}
+
+static void lat_set_patch(void) {
+  // algorithm 7, fast attack and release, all slots audible
+  g.param.alg = 7;
+  g.param.fbl = 0;
+  for (int s = 0; s < 4; s++) {
+    g.param.slot[s].ar = 31;
+    g.param.slot[s].dr = 0;
+    g.param.slot[s].sr = 0;
+    g.param.slot[s].rr = 15;
+    g.param.slot[s].sl = 0;
+    g.param.slot[s].tl = 0;
+    g.param.slot[s].ml = 1;
+  }
+  publish_patch();
+}
+
+// returns false if the note never sounded
+static bool lat_trial(double *ms) {
+  SDL_KeyboardEvent ke = {0};
+  ke.type = SDL_KEYDOWN;
+  ke.state = SDL_PRESSED;
+  ke.keysym.scancode = SDL_SCANCODE_D;
+  Uint64 freq = SDL_GetPerformanceFrequency();
+  Uint64 start = SDL_GetPerformanceCounter();
+  SDL_AtomicSet(&g.lat.armed, 1);
+  handle_key_tone(&ke);
+  bool sounded = false;
+  while (SDL_GetPerformanceCounter() - start < freq) {
+    if (!SDL_AtomicGet(&g.lat.armed)) {
+      SDL_MemoryBarrierAcquire();
+      sounded = true;
+      break;
+    }
+    SDL_Delay(1);
+  }
+  SDL_AtomicSet(&g.lat.armed, 0);
+  if (sounded) {
+    *ms = (double)(Sint64)(g.lat.detected - start) * 1000.0 / freq;
+  }
+  ke.type = SDL_KEYUP;
+  ke.state = SDL_RELEASED;
+  handle_key_tone(&ke);
+  // let the release finish, jittered so injections hit all callback phases
+  SDL_Delay(40 + rand() % 23);
+  return sounded;
+}
+
+static int latency_test(void) {
+  static const unsigned bufsizes[] = {128, 256, 512, 1024, 2048};
+  printf("%-12s %6s %8s %8s %8s %8s %6s\n",
+         "mode", "buf", "p50ms", "p90ms", "p99ms", "maxms", "lost");
+  for (int mode = 0; mode < 2; mode++) {
+    for (size_t b = 0; b < SDL_arraysize(bufsizes); b++) {
+      g.ahead.enabled = mode == 1;
+      g.ahead.depth = bufsizes[b];
+      if (!reopenaudio(bufsizes[b])) {
+        fprintf(stderr, "failed to open audio with %u samples\n", bufsizes[b]);
+        return 1;
+      }
+      lat_set_patch();
+      double ms[LAT_TRIALS];
+      int n = 0, lost = 0;
+      for (int t = 0; t < LAT_TRIALS; t++) {
+        if (lat_trial(&ms[n])) n++;
+        else lost++;
+        if (g.trace.enabled) trace_drain();
+      }
+      qsort(ms, n, sizeof(ms[0]), lat_cmp);
+      printf("%-12s %6u %8.2f %8.2f %8.2f %8.2f %6d\n",
+             mode ? "render-ahead" : "callback", bufsizes[b],
+             n ? ms[n*50/100] : 0.0, n ? ms[n*90/100] : 0.0,
+             n ? ms[n*99/100] : 0.0, n ? ms[n-1] : 0.0, lost);
+    }
+  }
+  return 0;
+}
+
+// only ever fires in builds with -DOPNATEST_RTCHECK
+static void rt_assert(void) {
+  struct rt_check_stats st;
+  if (!rt_check_get(&st)) return;
+  fprintf(stderr, "audiocb is not real-time safe: "
+          "%lu allocations, %lu locks, %lu page faults, %lu blocking calls\n",
+          st.allocs, st.locks, st.faults, st.blocks);
+  abort();
+}
+
+static void usage(const char *name) {
+  printf("usage: %s [-a samples] [-A] [-L] [-R] [-c cpu] [-v voices] [-C ms] [-b bank [-p name]] [-t trace]\n", name);
+  printf("  -a samples  render ahead in a separate thread, keeping samples buffered\n");
+  printf("  -A          adaptive audio buffer size from the measured render cost, starting at %d\n",
+         ADAPT_MIN_SAMPLES);
+  printf("  -L          headless key to sound latency test over buffer sizes and modes\n");
+  printf("  -R          real-time mode: lock memory, SCHED_FIFO for the audio threads\n");
+  printf("  -c cpu      pin the audio threads to cpu, requires -R\n");
+  printf("  -v voices   polyphony, 1-%d (default %d)\n", FM_VOICE_MAX, VOICE_NUM);
+  printf("  -C ms       cache the first ms of repeated notes instead of synthesizing them\n");
+  printf("  -b bank     voice bank, F5/F6 select, F4 stores; created on first store\n");
+  printf("  -p name     voice to select from the bank\n");
+  printf("  -t trace    record key and voice changes for opnareplay\n");
+}
+
+// after the audio device is closed, so the end mark covers every sample
+static void trace_close(void) {
+  if (!g.trace.enabled) return;
+  g.trace.enabled = false;
+  trace_drain();
+  if (g.trace.lost) fprintf(stderr, "%s: %u events lost\n", g.trace.path, g.trace.lost);
+  if (!opna_trace_close(&g.trace.w, SDL_AtomicGet(&g.trace.pos))) {
+    fprintf(stderr, "error writing %s\n", g.trace.path);
+  }
+}
+
+static bool parse_args(int argc, char **argv) {
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-a") && i+1 < argc) {
+      int depth = atoi(argv[++i]);
+      if (depth <= 0) return false;
+      g.ahead.enabled = true;
+      g.ahead.depth = depth;
+    } else if (!strcmp(argv[i], "-A")) {
+      g.adapt.enabled = true;
+    } else if (!strcmp(argv[i], "-L")) {
+      g.lat.enabled = true;
+    } else if (!strcmp(argv[i], "-R")) {
+      g.rt.enabled = true;
+    } else if (!strcmp(argv[i], "-c") && i+1 < argc) {
+      g.rt.cpu = atoi(argv[++i]);
+      if (g.rt.cpu < 0) return false;
+    } else if (!strcmp(argv[i], "-v") && i+1 < argc) {
+      int voices = atoi(argv[++i]);
+      if (voices <= 0 || voices > FM_VOICE_MAX) return false;
+      g.voices = voices;
+    } else if (!strcmp(argv[i], "-C") && i+1 < argc) {
+      int ms = atoi(argv[++i]);
+      if (ms <= 0) return false;
+      g.cache_ms = ms;
+    } else if (!strcmp(argv[i], "-b") && i+1 < argc) {
+      g.bank.path = argv[++i];
+    } else if (!strcmp(argv[i], "-p") && i+1 < argc) {
+      g.bank.select = argv[++i];
+    } else if (!strcmp(argv[i], "-t") && i+1 < argc) {
+      g.trace.path = argv[++i];
+    } else {
+      return false;
+    }
+  }
+  // pinning is part of the real-time setup, alone it would do nothing
+  if (g.rt.cpu >= 0 && !g.rt.enabled) return false;
+  return true;
+}
+
 int main(int argc, char **argv) {
-  (void)argc, (void)argv;
   g.octave = 4;
+  opna_prof_reset(&g.prof_cb);
+  opna_prof_reset(&g.prof_synth);
+  g.rt.cpu = -1;
+  g.voices = VOICE_NUM;
+  g.bank.cur = -1;
+
+  if (!parse_args(argc, argv)) {
+    usage(argv[0]);
+    return 1;
+  }
+  // voices start out reset
+  if (!fm_voicepool_init(&g.pool, g.voices)) {
+    fprintf(stderr, "failed to allocate %u voices\n", g.voices);
+    return 1;
+  }
+  // auditioning repeats the same few notes
+  if (g.cache_ms && !fm_voicepool_set_cache(&g.pool, 64, g.cache_ms)) {
+    fprintf(stderr, "failed to allocate the note cache\n");
+    fm_voicepool_free(&g.pool);
+    return 1;
+  }
+  if (g.trace.path) {
+    if (!opna_trace_open(&g.trace.w, g.trace.path, g.voices)) {
+      fprintf(stderr, "cannot write %s\n", g.trace.path);
+      fm_voicepool_free(&g.pool);
+      return 1;
+    }
+    g.trace.enabled = true;
+    // the voice in effect from the start
+    publish_patch();
+  }
+  // a missing file is an empty bank
+  if (g.bank.path && opna_bank_open(&g.bank.bank, g.bank.path)) {
+    long i = g.bank.select ? opna_bank_find(&g.bank.bank, g.bank.select) : 0;
+    if (i < 0) fprintf(stderr, "%s: no voice named %s\n", g.bank.path, g.bank.select);
+    bank_select(i);
+  }
+  if (g.rt.enabled) {
+    if (!rt_lock_memory()) {
+      fprintf(stderr, "warning: could not lock memory, page faults may cause dropouts\n");
+    }
+    // synthesis state and the font buffer live in g
+    rt_prefault(&g, sizeof(g));
+    rt_prefault(g.pool.voice, sizeof(*g.pool.voice) * g.pool.count);
+  }
 
+  if (g.lat.enabled) {
+    SDL_setenv("SDL_AUDIODRIVER", "dummy", 1);
+    SDL_setenv("SDL_VIDEODRIVER", "dummy", 1);
+  }
   if (SDL_Init(SDL_INIT_VIDEO|SDL_INIT_AUDIO) != 0) {
+    trace_close();
+    fm_voicepool_free(&g.pool);
     return 0;
   }
+  if (g.lat.enabled) {
+    int ret = latency_test();
+    if (g.ad) SDL_CloseAudioDevice(g.ad);
+    stop_ahead();
+    SDL_Quit();
+    trace_close();
+    fm_voicepool_free(&g.pool);
+    return ret;
+  }
   
   puts(SDL_GetPrefPath("tak", "opnatest"));
   
-  if (!openaudio()) {
+  if (!openaudio(g.adapt.enabled ? ADAPT_MIN_SAMPLES : 1024)) {
     SDL_ShowSimpleMessageBox(
       SDL_MESSAGEBOX_ERROR,
       "audio open error",
@@ -766,14 +1626,23 @@ int main(int argc, char **argv) {
     );
     goto err_renderer;
   }
+  // without it every glyph is copied on each redraw
+  create_texttex();
+  // F2 stays inert without it
+  viz_init();
 
   SDL_SetRenderDrawColor(g.renderer, 0, 0, 0, 0);
   render();
 
   SDL_Event e;
   for (;;) {
-    if (!SDL_WaitEvent(&e)) {
-      goto err_mainwin;
+    if (g.trace.enabled) trace_drain();
+    // timeout: refresh the statistics line, or the scope at ~30fps
+    if (!SDL_WaitEventTimeout(&e, g.viz.enabled ? 33 : 500)) {
+      rt_assert();
+      adapt_audio();
+      render();
+      continue;
     }
     switch (e.type) {
     case SDL_QUIT:
@@ -796,6 +1665,11 @@ err_renderer:
 err_mainwin:
   SDL_DestroyWindow(g.mainwin);
 err_sdl:
+  if (g.ad) SDL_CloseAudioDevice(g.ad);
+  stop_ahead();
   SDL_Quit();
+  trace_close();
+  opna_bank_close(&g.bank.bank);
+  fm_voicepool_free(&g.pool);
   return 0;
 }
@@ -0,0 +1,285 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "opnamidi.h"
+#include "opnarender.h"
+#include "opnaplayer.h"
+#include "opnaprof.h"
+#include "wavfile.h"
+
+// frames per fm_opna_render call when nothing happens in between
+#define SPAN_MAX 65536
+
+static uint8_t *readfile(const char *path, size_t *size) {
+  FILE *f = fopen(path, "rb");
+  if (!f) return 0;
+  uint8_t *data = 0;
+  if (fseek(f, 0, SEEK_END)) goto err;
+  long len = ftell(f);
+  if (len < 0 || fseek(f, 0, SEEK_SET)) goto err;
+  data = malloc(len ? len : 1);
+  if (!data) goto err;
+  if (fread(data, 1, len, f) != (size_t)len) goto err;
+  fclose(f);
+  *size = len;
+  return data;
+err:
+  free(data);
+  fclose(f);
+  return 0;
+}
+
+static bool render(const struct opna_midi *midi, struct wavfile *wav,
+                   struct fm_opna_stats *stats) {
+  static int16_t obuf[SPAN_MAX*2];
+  struct fm_opna opna;
+  fm_opna_reset(&opna);
+  uint32_t pos = 0;
+  size_t i = 0;
+  while (pos < midi->samples) {
+    while (i < midi->writes && midi->log[i].sample <= pos) {
+      fm_opna_fmwritereg(&opna, midi->log[i].reg, midi->log[i].val);
+      i++;
+    }
+    uint32_t next = i < midi->writes ? midi->log[i].sample : midi->samples;
+    if (next > midi->samples) next = midi->samples;
+    while (pos < next) {
+      unsigned len = next - pos;
+      if (len > SPAN_MAX) len = SPAN_MAX;
+      fm_opna_render(&opna, FM_OPNA_S16, obuf, 0, len);
+      if (!wavfile_write(wav, obuf, len)) return false;
+      pos += len;
+    }
+  }
+  fm_opna_get_stats(&opna, stats);
+  return true;
+}
+
+struct play_opt {
+  const char *indexpath;
+  uint32_t start;
+  uint32_t length;
+  uint32_t loop_start;
+  uint32_t loop_end;
+};
+
+// renders through opna_player, for a start position or a loop
+static bool render_player(const struct opna_midi *midi, struct wavfile *wav,
+                          const struct play_opt *o, struct fm_opna_stats *stats) {
+  enum { BLOCK = 4096 };
+  static int32_t lbuf[BLOCK], rbuf[BLOCK], sbuf[BLOCK*2];
+  static int16_t obuf[BLOCK*2];
+  bool ok = false;
+  struct opna_seekindex index;
+  struct opna_loopcache cache = {0};
+  struct fm_opna *opna = malloc(sizeof(*opna));
+  struct opna_player *player = malloc(sizeof(*player));
+  if (!opna || !player) goto out;
+  opna_seekindex_init(&index, 5*FM_OPNA_SAMPLERATE);
+  // a missing or stale index file is rebuilt and written at the end
+  bool loaded = o->indexpath && opna_seekindex_load(&index, o->indexpath);
+  fm_opna_reset(opna);
+  opna_player_init(player, opna, midi->log, midi->writes, &index);
+  if (o->loop_end) {
+    if (!opna_loopcache_init(&cache, o->loop_end - o->loop_start)) goto out_index;
+    if (!opna_player_set_loop(player, o->loop_start, o->loop_end, &cache)) {
+      fprintf(stderr, "loop end must be after the loop start\n");
+      goto out_index;
+    }
+  }
+  opna_player_seek(player, o->start);
+  for (uint32_t done = 0; done < o->length;) {
+    unsigned len = o->length - done;
+    if (len > BLOCK) len = BLOCK;
+    opna_player_render(player, lbuf, rbuf, len);
+    for (unsigned i = 0; i < len; i++) {
+      sbuf[i*2+0] = lbuf[i];
+      sbuf[i*2+1] = rbuf[i];
+    }
+    wavfile_convert(obuf, sbuf, len*2);
+    if (!wavfile_write(wav, obuf, len)) goto out_index;
+    done += len;
+  }
+  if (o->indexpath && !loaded && !opna_seekindex_save(&index, o->indexpath)) {
+    fprintf(stderr, "cannot write index %s\n", o->indexpath);
+  }
+  fm_opna_get_stats(&player->opna, stats);
+  ok = true;
+out_index:
+  opna_loopcache_free(&cache);
+  opna_seekindex_free(&index);
+out:
+  free(player);
+  free(opna);
+  return ok;
+}
+
+// seconds to samples, false on garbage or beyond 32bit positions
+static bool parse_time(const char *s, uint32_t *sample) {
+  char *end;
+  double sec = strtod(s, &end);
+  if (end == s || *end || !(sec >= 0.0)) return false;
+  double n = sec * FM_OPNA_SAMPLERATE;
+  if (n > UINT32_MAX) return false;
+  *sample = (uint32_t)n;
+  return true;
+}
+
+// only when built with -DLIBOPNA_ENABLE_STATS
+static void print_stats(const struct fm_opna_stats *st) {
+  static const char *const class[FM_OPNA_WRITE_CLASSES] = {
+    "rhythm", "mode", "key", "slot", "freq", "channel", "other",
+  };
+  printf("active:");
+  for (int c = 0; c < 6; c++) {
+    printf(" %.0f%%", st->samples ? 100.0 * st->active[c] / st->samples : 0.0);
+  }
+  printf(", %llu key ons, %llu envelope transitions\n",
+         (unsigned long long)st->keyons, (unsigned long long)st->env_transitions);
+  printf("writes:");
+  for (int i = 0; i < FM_OPNA_WRITE_CLASSES; i++) {
+    printf(" %s %llu", class[i], (unsigned long long)st->writes[i]);
+  }
+  printf(", %llu redundant\n", (unsigned long long)st->redundant);
+}
+
+// renders the log again on channel threads, the counters must be the
+// same as those of the serial render
+static bool check_parallel(const struct opna_midi *midi, const struct fm_opna_stats *serial) {
+  int32_t *buf = calloc((size_t)midi->samples * 2 + 2, sizeof(int32_t));
+  struct fm_opna *opna = calloc(1, sizeof(*opna));
+  bool ok = false;
+  if (!buf || !opna) {
+    fprintf(stderr, "cannot allocate %u samples for the check\n", midi->samples);
+    goto out;
+  }
+  fm_opna_reset(opna);
+  if (!opna_render_log_parallel(opna, midi->log, midi->writes, buf, buf + midi->samples + 1,
+                                midi->samples, 3)) {
+    fprintf(stderr, "cannot start render threads\n");
+    goto out;
+  }
+  struct fm_opna_stats stats;
+  fm_opna_get_stats(opna, &stats);
+  ok = !memcmp(&stats, serial, sizeof(stats));
+  printf("parallel render stats: %s\n", ok ? "same" : "different");
+  if (!ok) print_stats(&stats);
+out:
+  free(opna);
+  free(buf);
+  return ok;
+}
+
+static void usage(const char *name) {
+  printf("usage: %s [-b bank] [-c] [-s sec] [-t sec] [-l start end] [-i index] in.mid out.wav\n", name);
+  printf("  -b bank       program n plays voice n of the bank\n");
+  printf("  -c            compare the stats with a channel-parallel render (STATS=1 builds)\n");
+  printf("  -s sec        start the output at sec seconds into the song\n");
+  printf("  -t sec        output length, by default up to the end of the song\n");
+  printf("  -l start end  loop between the two times in seconds\n");
+  printf("  -i index      seek index, read when valid and written otherwise\n");
+}
+
+int main(int argc, char **argv) {
+  const char *bankpath = 0;
+  bool check = false;
+  struct play_opt play = {0};
+  const char *lengtharg = 0;
+  // the player is only used when one of its options is given
+  bool player = false;
+  bool badtime = false;
+  int argi = 1;
+  for (;;) {
+    if (argi+1 < argc && !strcmp(argv[argi], "-b")) {
+      bankpath = argv[argi+1];
+      argi += 2;
+    } else if (argi < argc && !strcmp(argv[argi], "-c")) {
+      check = true;
+      argi++;
+    } else if (argi+1 < argc && !strcmp(argv[argi], "-s")) {
+      if (!parse_time(argv[argi+1], &play.start)) badtime = true;
+      player = true;
+      argi += 2;
+    } else if (argi+1 < argc && !strcmp(argv[argi], "-t")) {
+      lengtharg = argv[argi+1];
+      player = true;
+      argi += 2;
+    } else if (argi+2 < argc && !strcmp(argv[argi], "-l")) {
+      if (!parse_time(argv[argi+1], &play.loop_start)) badtime = true;
+      if (!parse_time(argv[argi+2], &play.loop_end)) badtime = true;
+      if (play.loop_end <= play.loop_start) badtime = true;
+      player = true;
+      argi += 3;
+    } else if (argi+1 < argc && !strcmp(argv[argi], "-i")) {
+      play.indexpath = argv[argi+1];
+      player = true;
+      argi += 2;
+    } else {
+      break;
+    }
+  }
+  if (lengtharg && (!parse_time(lengtharg, &play.length) || !play.length)) badtime = true;
+  // the stats of a partial or looped render have nothing to compare with
+  if (argc - argi != 2 || badtime || (check && player)) {
+    usage(argv[0]);
+    return 1;
+  }
+  const char *inpath = argv[argi], *outpath = argv[argi+1];
+
+  int ret = 1;
+  struct opna_bank bank = {0};
+  struct opna_midi midi = {0};
+  size_t size;
+  uint8_t *smf = readfile(inpath, &size);
+  if (!smf) {
+    fprintf(stderr, "cannot read %s\n", inpath);
+    return 1;
+  }
+  if (bankpath && !opna_bank_open(&bank, bankpath)) {
+    fprintf(stderr, "cannot open bank %s\n", bankpath);
+    goto err_smf;
+  }
+  uint64_t start = opna_prof_now();
+  if (!opna_midi_convert(&midi, smf, size, bankpath ? &bank : 0)) {
+    fprintf(stderr, "%s: not a valid midi file\n", inpath);
+    goto err_bank;
+  }
+  if (player && !lengtharg) {
+    if (play.start >= midi.samples) {
+      fprintf(stderr, "%s is shorter than the start position\n", inpath);
+      goto err_midi;
+    }
+    play.length = midi.samples - play.start;
+  }
+  struct wavfile wav;
+  if (!wavfile_open(&wav, outpath, FM_OPNA_SAMPLERATE, 2)) {
+    fprintf(stderr, "cannot write %s\n", outpath);
+    goto err_midi;
+  }
+  struct fm_opna_stats stats;
+  bool ok = player ? render_player(&midi, &wav, &play, &stats)
+                   : render(&midi, &wav, &stats);
+  if (!wavfile_close(&wav)) ok = false;
+  if (!ok) {
+    fprintf(stderr, "error writing %s\n", outpath);
+    goto err_midi;
+  }
+  double sec = (double)(opna_prof_now() - start) / 1e9;
+  double len = (double)(player ? play.length : midi.samples) / FM_OPNA_SAMPLERATE;
+  printf("%s: %.1fs in %.2fs (%.0fx real time), %zu register writes\n",
+         outpath, len, sec, sec > 0 ? len / sec : 0.0, midi.writes);
+  if (stats.samples) print_stats(&stats);
+  if (check && !stats.samples) {
+    fprintf(stderr, "built without stats, nothing to compare\n");
+    goto err_midi;
+  }
+  if (check && !check_parallel(&midi, &stats)) goto err_midi;
+  ret = 0;
+err_midi:
+  opna_midi_free(&midi);
+err_bank:
+  opna_bank_close(&bank);
+err_smf:
+  free(smf);
+  return ret;
+}
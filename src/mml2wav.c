@@ -0,0 +1,139 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "opnamml.h"
+#include "opnaprof.h"
+#include "wavfile.h"
+
+#define BLOCK 4096
+// release tail after every part has ended
+#define TAIL_SEC 1
+
+static char *readfile(const char *path) {
+  FILE *f = fopen(path, "rb");
+  if (!f) return 0;
+  char *data = 0;
+  if (fseek(f, 0, SEEK_END)) goto err;
+  long len = ftell(f);
+  if (len < 0 || fseek(f, 0, SEEK_SET)) goto err;
+  data = malloc(len + 1);
+  if (!data) goto err;
+  if (fread(data, 1, len, f) != (size_t)len) goto err;
+  data[len] = 0;
+  fclose(f);
+  return data;
+err:
+  free(data);
+  fclose(f);
+  return 0;
+}
+
+struct instance {
+  struct opna_mmldrv drv;
+  struct fm_opna opna;
+};
+
+// instance 0 goes to wav, the others only run alongside it
+static bool render(struct instance *inst, int count, struct wavfile *wav,
+                   unsigned long maxframes, unsigned long *frames) {
+  static int16_t obuf[BLOCK*2];
+  unsigned long pos = 0, tail = (unsigned long)TAIL_SEC * FM_OPNA_SAMPLERATE;
+  while (pos < maxframes && tail) {
+    unsigned len = BLOCK;
+    if (len > maxframes - pos) len = maxframes - pos;
+    if (!inst[0].drv.playing && len > tail) len = tail;
+    for (int i = 0; i < count; i++) {
+      opna_mmldrv_render(&inst[i].drv, &inst[i].opna, FM_OPNA_S16, obuf, 0, len);
+      if (!i && !wavfile_write(wav, obuf, len)) return false;
+    }
+    if (!inst[0].drv.playing) tail -= len;
+    pos += len;
+  }
+  *frames = pos;
+  return true;
+}
+
+static void usage(const char *name) {
+  printf("usage: %s [-b bank] [-n instances] [-l seconds] in.mml out.wav\n", name);
+  printf("  -b bank       @n plays voice n of the bank\n");
+  printf("  -n instances  run this many drivers at once (default 1)\n");
+  printf("  -l seconds    stop after this long (default 600)\n");
+}
+
+int main(int argc, char **argv) {
+  const char *bankpath = 0;
+  int count = 1;
+  long maxsec = 600;
+  int argi = 1;
+  while (argi+1 < argc && argv[argi][0] == '-') {
+    if (!strcmp(argv[argi], "-b")) {
+      bankpath = argv[argi+1];
+    } else if (!strcmp(argv[argi], "-n")) {
+      count = atoi(argv[argi+1]);
+    } else if (!strcmp(argv[argi], "-l")) {
+      maxsec = atol(argv[argi+1]);
+    } else {
+      break;
+    }
+    argi += 2;
+  }
+  if (argc - argi != 2 || count < 1 || maxsec < 1) {
+    usage(argv[0]);
+    return 1;
+  }
+  const char *inpath = argv[argi], *outpath = argv[argi+1];
+
+  int ret = 1;
+  struct opna_bank bank = {0};
+  struct opna_mml mml;
+  struct instance *inst = 0;
+  char *text = readfile(inpath);
+  if (!text) {
+    fprintf(stderr, "cannot read %s\n", inpath);
+    return 1;
+  }
+  if (bankpath && !opna_bank_open(&bank, bankpath)) {
+    fprintf(stderr, "cannot open bank %s\n", bankpath);
+    goto err_text;
+  }
+  if (!opna_mml_compile(&mml, text)) {
+    fprintf(stderr, "%s:%u: syntax error\n", inpath, mml.errline);
+    goto err_bank;
+  }
+  inst = malloc(sizeof(*inst) * count);
+  if (!inst) {
+    fprintf(stderr, "cannot allocate %d instances\n", count);
+    goto err_mml;
+  }
+  for (int i = 0; i < count; i++) {
+    fm_opna_reset(&inst[i].opna);
+    opna_mmldrv_init(&inst[i].drv, &mml, bankpath ? &bank : 0);
+  }
+  struct wavfile wav;
+  if (!wavfile_open(&wav, outpath, FM_OPNA_SAMPLERATE, 2)) {
+    fprintf(stderr, "cannot write %s\n", outpath);
+    goto err_inst;
+  }
+  uint64_t start = opna_prof_now();
+  unsigned long frames = 0;
+  bool ok = render(inst, count, &wav, (unsigned long)maxsec * FM_OPNA_SAMPLERATE, &frames);
+  if (!wavfile_close(&wav)) ok = false;
+  if (!ok) {
+    fprintf(stderr, "error writing %s\n", outpath);
+    goto err_inst;
+  }
+  double sec = (double)(opna_prof_now() - start) / 1e9;
+  double len = (double)frames / FM_OPNA_SAMPLERATE;
+  printf("%s: %.1fs x %d in %.2fs (%.1fx real time per instance), %zu bytes of code\n",
+         outpath, len, count, sec, sec > 0 ? len * count / sec : 0.0, mml.size);
+  ret = 0;
+err_inst:
+  free(inst);
+err_mml:
+  opna_mml_free(&mml);
+err_bank:
+  opna_bank_close(&bank);
+err_text:
+  free(text);
+  return ret;
+}
@@ -0,0 +1,282 @@
+#include "opnabank.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define BANK_MAGIC "OPNABANK"
+#define BANK_VERSION 1
+#define BANK_HEADER_SIZE 32
+
+_Static_assert(sizeof(struct opna_bankpatch) == 96, "bank patch layout");
+
+// two 2-op stacks, slots 1 and 3 are the carriers
+static const struct fm_patch default_patch = {
+  .alg = 4,
+  .fb = 5,
+  .slot = {
+    // ar dr sr rr sl tl ks mul det
+    {31, 8, 2, 6, 3, 28, 1, 2, 0},
+    {31, 6, 2, 7, 2,  0, 1, 1, 0},
+    {31, 8, 2, 6, 3, 32, 1, 1, 0},
+    {31, 6, 2, 7, 2,  0, 1, 1, 0},
+  },
+};
+
+// register offset 0, 4, 8, c is slot 0, 2, 1, 3
+static const int regslot[4] = {0, 2, 1, 3};
+
+// header, all little endian:
+//   0 magic, 8 version, 12 count, 16 index_size, 20 patch offset,
+//   24 index offset, 28 reserved
+// index entries are u32 patch number + 1, 0 when empty
+
+static uint32_t le32(const uint8_t *p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void put_le32(uint8_t *p, uint32_t v) {
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+// fnv-1a over the name up to the first NUL
+static uint32_t bank_hash(const char *name) {
+  uint32_t h = 2166136261u;
+  for (int i = 0; i < OPNA_BANK_NAMELEN && name[i]; i++) {
+    h ^= (uint8_t)name[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+static bool bank_name_eq(const char *bankname, const char *name) {
+  return !strncmp(bankname, name, OPNA_BANK_NAMELEN) &&
+         (strlen(name) <= OPNA_BANK_NAMELEN);
+}
+
+static bool bank_map(struct opna_bank *bank, const char *path) {
+#ifdef _WIN32
+  HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, 0,
+                            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+  if (file == INVALID_HANDLE_VALUE) return false;
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(file, &size) || !size.QuadPart) goto err_file;
+  HANDLE mapping = CreateFileMappingA(file, 0, PAGE_READONLY, 0, 0, 0);
+  if (!mapping) goto err_file;
+  void *map = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+  if (!map) goto err_mapping;
+  bank->file = file;
+  bank->mapping = mapping;
+  bank->map = map;
+  bank->size = size.QuadPart;
+  return true;
+err_mapping:
+  CloseHandle(mapping);
+err_file:
+  CloseHandle(file);
+  return false;
+#else
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return false;
+  struct stat st;
+  if (fstat(fd, &st) || !st.st_size) goto err;
+  void *map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED) goto err;
+  close(fd);
+  bank->map = map;
+  bank->size = st.st_size;
+  return true;
+err:
+  close(fd);
+  return false;
+#endif
+}
+
+bool opna_bank_open(struct opna_bank *bank, const char *path) {
+  memset(bank, 0, sizeof(*bank));
+  if (!bank_map(bank, path)) return false;
+  const uint8_t *h = bank->map;
+  if (bank->size < BANK_HEADER_SIZE) goto err;
+  if (memcmp(h, BANK_MAGIC, 8)) goto err;
+  if (le32(h+8) != BANK_VERSION) goto err;
+  uint32_t count = le32(h+12);
+  uint32_t index_size = le32(h+16);
+  uint32_t patch_off = le32(h+20);
+  uint32_t index_off = le32(h+24);
+  // the lookup relies on at least one empty entry
+  if (index_size <= count || (index_size & (index_size-1))) goto err;
+  if (patch_off > bank->size ||
+      (bank->size - patch_off) / sizeof(struct opna_bankpatch) < count) goto err;
+  if (index_off > bank->size || (bank->size - index_off) / 4 < index_size) goto err;
+  bank->patch = (const struct opna_bankpatch *)(bank->map + patch_off);
+  bank->count = count;
+  bank->index = bank->map + index_off;
+  bank->index_size = index_size;
+  return true;
+err:
+  opna_bank_close(bank);
+  return false;
+}
+
+void opna_bank_close(struct opna_bank *bank) {
+  if (bank->map) {
+#ifdef _WIN32
+    UnmapViewOfFile(bank->map);
+    CloseHandle(bank->mapping);
+    CloseHandle(bank->file);
+#else
+    munmap((void *)bank->map, bank->size);
+#endif
+  }
+  memset(bank, 0, sizeof(*bank));
+}
+
+long opna_bank_find(const struct opna_bank *bank, const char *name) {
+  if (!bank->index_size) return -1;
+  uint32_t mask = bank->index_size - 1;
+  // a damaged index may have no empty entry left
+  uint32_t i = bank_hash(name) & mask;
+  for (uint32_t n = 0; n < bank->index_size; n++, i = (i+1) & mask) {
+    uint32_t e = le32(bank->index + 4*i);
+    if (!e) return -1;
+    if (e > bank->count) return -1;
+    if (bank_name_eq(bank->patch[e-1].name, name)) return e-1;
+  }
+  return -1;
+}
+
+void opna_bankpatch_set(struct opna_bankpatch *bp, const char *name,
+                        const struct fm_patch *patch) {
+  memset(bp, 0, sizeof(*bp));
+  size_t len = strlen(name);
+  if (len > OPNA_BANK_NAMELEN) len = OPNA_BANK_NAMELEN;
+  memcpy(bp->name, name, len);
+  bp->patch = *patch;
+  for (int k = 0; k < 4; k++) {
+    const struct fm_patch_slot *s = &patch->slot[regslot[k]];
+    bp->regs[0*4+k] = ((s->det & 0x7) << 4) | (s->mul & 0xf);
+    bp->regs[1*4+k] = s->tl & 0x7f;
+    bp->regs[2*4+k] = ((s->ks & 0x3) << 6) | (s->ar & 0x1f);
+    bp->regs[3*4+k] = s->dr & 0x1f;
+    bp->regs[4*4+k] = s->sr & 0x1f;
+    bp->regs[5*4+k] = ((s->sl & 0xf) << 4) | (s->rr & 0xf);
+  }
+  bp->regs[24] = ((patch->fb & 0x7) << 3) | (patch->alg & 0x7);
+}
+
+static bool bank_sync(FILE *f) {
+  if (fflush(f)) return false;
+#ifdef _WIN32
+  return FlushFileBuffers((HANDLE)_get_osfhandle(_fileno(f)));
+#else
+  return !fsync(fileno(f));
+#endif
+}
+
+static bool bank_replace(const char *tmp, const char *path, struct opna_bank *mapped) {
+#ifdef _WIN32
+  // a mapped file cannot be replaced
+  if (mapped) opna_bank_close(mapped);
+  return MoveFileExA(tmp, path, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+#else
+  (void)mapped;
+  return !rename(tmp, path);
+#endif
+}
+
+bool opna_bank_save(const char *path, const struct opna_bankpatch *patches, uint32_t count,
+                    struct opna_bank *mapped) {
+  uint32_t index_size = 16;
+  // load factor at most 1/2
+  while (index_size < count * 2u) index_size <<= 1;
+  uint8_t *index = calloc(index_size, 4);
+  if (!index) return false;
+  uint32_t mask = index_size - 1;
+  for (uint32_t p = 0; p < count; p++) {
+    char name[OPNA_BANK_NAMELEN+1] = {0};
+    memcpy(name, patches[p].name, OPNA_BANK_NAMELEN);
+    for (uint32_t i = bank_hash(name) & mask;; i = (i+1) & mask) {
+      uint32_t e = le32(index + 4*i);
+      if (!e) {
+        put_le32(index + 4*i, p+1);
+        break;
+      }
+      // duplicate names: the first one wins
+      if (!strncmp(patches[e-1].name, name, OPNA_BANK_NAMELEN)) break;
+    }
+  }
+
+  uint8_t h[BANK_HEADER_SIZE] = {0};
+  uint32_t patch_off = BANK_HEADER_SIZE;
+  uint32_t index_off = patch_off + count * sizeof(struct opna_bankpatch);
+  memcpy(h, BANK_MAGIC, 8);
+  put_le32(h+8, BANK_VERSION);
+  put_le32(h+12, count);
+  put_le32(h+16, index_size);
+  put_le32(h+20, patch_off);
+  put_le32(h+24, index_off);
+
+  // written next to path and renamed over it once complete, a failed save
+  // leaves the old bank as it was
+  bool ok = false;
+  size_t len = strlen(path);
+  char *tmp = malloc(len + 5);
+  if (!tmp) goto err;
+  memcpy(tmp, path, len);
+  memcpy(tmp + len, ".tmp", 5);
+  FILE *f = fopen(tmp, "wb");
+  if (!f) goto err_tmp;
+  ok = fwrite(h, sizeof(h), 1, f) == 1;
+  if (ok && count) ok = fwrite(patches, sizeof(*patches), count, f) == count;
+  if (ok) ok = fwrite(index, 4, index_size, f) == index_size;
+  if (ok) ok = bank_sync(f);
+  if (fclose(f)) ok = false;
+  if (ok) ok = bank_replace(tmp, path, mapped);
+  if (!ok) remove(tmp);
+err_tmp:
+  free(tmp);
+err:
+  free(index);
+  return ok;
+}
+
+unsigned opna_bank_regaddr(unsigned c, int i) {
+  unsigned base = (c % 3) | ((c / 3) << 8);
+  if (i == 24) return base + 0xb0;
+  return base + 0x30 + (i/4)*0x10 + (i%4)*4;
+}
+
+void opna_bank_writeregs(struct fm_opna *opna, unsigned c, const struct opna_bankpatch *bp) {
+  for (int i = 0; i < OPNA_BANK_REGS; i++) {
+    fm_opna_fmwritereg(opna, opna_bank_regaddr(c, i), bp->regs[i]);
+  }
+}
+
+void opna_bankpatch_attenuate(const struct opna_bankpatch *bp, unsigned att,
+                              uint8_t regs[OPNA_BANK_REGS]) {
+  unsigned car = fm_carriers[bp->regs[24] & 7];
+  memcpy(regs, bp->regs, OPNA_BANK_REGS);
+  // tl is the second row
+  for (int k = 0; k < 4; k++) {
+    if (!(car & (1 << regslot[k]))) continue;
+    unsigned tl = regs[4+k] + att;
+    regs[4+k] = tl > 127 ? 127 : tl;
+  }
+}
+
+void opna_bankpatch_default(struct opna_bankpatch *bp) {
+  opna_bankpatch_set(bp, "default", &default_patch);
+}
@@ -0,0 +1,70 @@
+#ifndef LIBOPNA_OPNABANK_H_INCLUDED
+#define LIBOPNA_OPNABANK_H_INCLUDED
+
+#include <stddef.h>
+#include "opnafm.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define OPNA_BANK_NAMELEN 32
+#define OPNA_BANK_REGS 25
+
+// 96 bytes, stored as is in the file
+struct opna_bankpatch {
+  // NUL padded, not terminated when all 32 are used
+  char name[OPNA_BANK_NAMELEN];
+  struct fm_patch patch;
+  // 0x30-0x8c of channel 0 in register order, then 0xb0
+  uint8_t regs[OPNA_BANK_REGS];
+  uint8_t reserved;
+};
+
+// read only view of a mapped bank file, nothing is parsed on open
+struct opna_bank {
+  const uint8_t *map;
+  size_t size;
+  // patch[0] to patch[count-1]
+  const struct opna_bankpatch *patch;
+  uint32_t count;
+  // name hash table, index_size is a power of 2
+  const uint8_t *index;
+  uint32_t index_size;
+#ifdef _WIN32
+  void *file;
+  void *mapping;
+#endif
+};
+
+bool opna_bank_open(struct opna_bank *bank, const char *path);
+void opna_bank_close(struct opna_bank *bank);
+// patch number or -1
+long opna_bank_find(const struct opna_bank *bank, const char *name);
+
+// fills regs from patch, name is truncated to OPNA_BANK_NAMELEN
+void opna_bankpatch_set(struct opna_bankpatch *bp, const char *name,
+                        const struct fm_patch *patch);
+// writes patches and their name index to path.tmp, syncs it and renames it
+// over path. mapped is a bank open on path or NULL: it keeps the old
+// contents and stays open, except on windows where it is closed before the
+// rename. on failure path is unchanged.
+bool opna_bank_save(const char *path, const struct opna_bankpatch *patches, uint32_t count,
+                    struct opna_bank *mapped);
+// the register block of bp to channel c (0-5), pitch and pan are left alone.
+// these are plain register writes, the chip state and stats are those of
+// any other writer of the same block
+void opna_bank_writeregs(struct fm_opna *opna, unsigned c, const struct opna_bankpatch *bp);
+// address of regs[i] on channel c
+unsigned opna_bank_regaddr(unsigned c, int i);
+// regs of bp with the carrier tl raised by att, e.g. for velocity
+void opna_bankpatch_attenuate(const struct opna_bankpatch *bp, unsigned att,
+                              uint8_t regs[OPNA_BANK_REGS]);
+// a plain two-carrier voice for when there is no bank
+void opna_bankpatch_default(struct opna_bankpatch *bp);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBOPNA_OPNABANK_H_INCLUDED */
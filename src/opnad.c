@@ -0,0 +1,356 @@
+// render server, see opnad.h for the protocol
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "opnad.h"
+#include "opnaprof.h"
+
+#define CLIENTS_MAX 1024
+// answers are sent blocking, a client not taking one for this long is dropped
+#define SEND_TIMEOUT_MS 1000
+
+struct client {
+  int fd;
+  int16_t *pcm;
+  // the request being rendered, OPNAD_MSG_MAX bytes
+  struct opnad_msg *req;
+  struct fm_opna opna;
+  // an answer could not be sent, removed after the batch
+  bool gone;
+};
+
+static struct {
+  int listen_fd;
+  struct client *client[CLIENTS_MAX];
+  unsigned nclients;
+
+  // requests of one poll round, collected by the main thread while the
+  // workers are idle. nbatch, next and done are only touched under mutex,
+  // the workers take requests until next reaches nbatch.
+  struct client *batch[CLIENTS_MAX];
+  unsigned npending;
+  unsigned nbatch;
+  unsigned next;
+  unsigned done;
+  bool quit;
+  pthread_mutex_t mutex;
+  pthread_cond_t work;
+  pthread_cond_t finished;
+  pthread_t *worker;
+  unsigned nworkers;
+
+  uint64_t requests;
+  uint64_t frames;
+  uint64_t batches;
+  uint64_t render_ns;
+} d;
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig) {
+  (void)sig;
+  stop = 1;
+}
+
+static void render_request(struct client *c) {
+  const struct opnad_msg *req = c->req;
+  if (req->type == OPNAD_RESET) {
+    memset(&c->opna, 0, sizeof(c->opna));
+    fm_opna_reset(&c->opna);
+    return;
+  }
+  unsigned pos = 0;
+  for (uint32_t i = 0; i < req->writes; i++) {
+    const struct opna_regwrite *w = &req->write[i];
+    if (w->sample > pos) {
+      fm_opna_render(&c->opna, FM_OPNA_S16, c->pcm + 2*pos, 0, w->sample - pos);
+      pos = w->sample;
+    }
+    fm_opna_fmwritereg(&c->opna, w->reg, w->val);
+  }
+  fm_opna_render(&c->opna, FM_OPNA_S16, c->pcm + 2*pos, 0, req->frames - pos);
+}
+
+static void *worker_thread(void *ptr) {
+  (void)ptr;
+  pthread_mutex_lock(&d.mutex);
+  for (;;) {
+    while (d.next == d.nbatch && !d.quit) pthread_cond_wait(&d.work, &d.mutex);
+    if (d.quit) break;
+    struct client *c = d.batch[d.next++];
+    pthread_mutex_unlock(&d.mutex);
+    // one instance at a time, its state stays in cache for the whole request
+    render_request(c);
+    pthread_mutex_lock(&d.mutex);
+    if (++d.done == d.nbatch) pthread_cond_signal(&d.finished);
+  }
+  pthread_mutex_unlock(&d.mutex);
+  return 0;
+}
+
+static bool workers_start(unsigned count) {
+  d.worker = calloc(count, sizeof(*d.worker));
+  if (!d.worker) return false;
+  for (; d.nworkers < count; d.nworkers++) {
+    if (pthread_create(&d.worker[d.nworkers], 0, worker_thread, 0)) break;
+  }
+  return d.nworkers;
+}
+
+static void workers_stop(void) {
+  pthread_mutex_lock(&d.mutex);
+  d.quit = true;
+  pthread_cond_broadcast(&d.work);
+  pthread_mutex_unlock(&d.mutex);
+  for (unsigned i = 0; i < d.nworkers; i++) pthread_join(d.worker[i], 0);
+  free(d.worker);
+}
+
+static void render_batch(void) {
+  pthread_mutex_lock(&d.mutex);
+  d.nbatch = d.npending;
+  d.next = 0;
+  d.done = 0;
+  pthread_cond_broadcast(&d.work);
+  while (d.done < d.nbatch) pthread_cond_wait(&d.finished, &d.mutex);
+  // next == nbatch again, the workers stay idle until the next batch
+  pthread_mutex_unlock(&d.mutex);
+}
+
+static bool send_msg(int fd, uint32_t type, uint32_t seq, uint32_t frames) {
+  struct opnad_msg msg = {type, seq, frames, 0};
+  return send(fd, &msg, sizeof(msg), MSG_NOSIGNAL) == sizeof(msg);
+}
+
+static void client_free(struct client *c) {
+  if (c->fd >= 0) close(c->fd);
+  if (c->pcm) munmap(c->pcm, OPNAD_SHM_SIZE);
+  free(c->req);
+  free(c);
+}
+
+static void client_accept(void) {
+  int fd = accept4(d.listen_fd, 0, 0, SOCK_CLOEXEC);
+  if (fd < 0) return;
+  if (d.nclients == CLIENTS_MAX) {
+    close(fd);
+    return;
+  }
+  struct client *c = calloc(1, sizeof(*c));
+  if (!c) {
+    close(fd);
+    return;
+  }
+  c->fd = fd;
+  struct timeval tv = {SEND_TIMEOUT_MS / 1000, SEND_TIMEOUT_MS % 1000 * 1000};
+  if (setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv))) goto err;
+  fm_opna_reset(&c->opna);
+  c->req = malloc(OPNAD_MSG_MAX);
+  if (!c->req) goto err;
+  int shm = memfd_create("opnad", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (shm < 0) goto err;
+  if (ftruncate(shm, OPNAD_SHM_SIZE)) goto err_shm;
+  // a client shrinking it would fault the render into c->pcm
+  if (fcntl(shm, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL)) goto err_shm;
+  c->pcm = mmap(0, OPNAD_SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, shm, 0);
+  if (c->pcm == MAP_FAILED) {
+    c->pcm = 0;
+    goto err_shm;
+  }
+
+  struct opnad_msg hello = {OPNAD_HELLO, 0, OPNAD_FRAMES_MAX, 0};
+  struct iovec iov = {&hello, sizeof(hello)};
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } ctl;
+  struct msghdr mh;
+  memset(&mh, 0, sizeof(mh));
+  mh.msg_iov = &iov;
+  mh.msg_iovlen = 1;
+  mh.msg_control = ctl.buf;
+  mh.msg_controllen = sizeof(ctl.buf);
+  struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+  cm->cmsg_level = SOL_SOCKET;
+  cm->cmsg_type = SCM_RIGHTS;
+  cm->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cm), &shm, sizeof(int));
+  if (sendmsg(fd, &mh, MSG_NOSIGNAL) != sizeof(hello)) goto err_shm;
+  // the mapping keeps it alive
+  close(shm);
+  d.client[d.nclients++] = c;
+  return;
+err_shm:
+  close(shm);
+err:
+  client_free(c);
+}
+
+static bool request_valid(const struct opnad_msg *req, ssize_t size) {
+  if (size < (ssize_t)sizeof(*req)) return false;
+  if (req->type == OPNAD_RESET) return size == sizeof(*req);
+  if (req->type != OPNAD_RENDER) return false;
+  if (!req->frames || req->frames > OPNAD_FRAMES_MAX || req->writes > OPNAD_WRITES_MAX) {
+    return false;
+  }
+  if ((size_t)size != sizeof(*req) + req->writes * sizeof(struct opna_regwrite)) return false;
+  uint32_t last = 0;
+  for (uint32_t i = 0; i < req->writes; i++) {
+    uint32_t t = req->write[i].sample;
+    if (t < last || t >= req->frames || req->write[i].reg >= 0x200) return false;
+    last = t;
+  }
+  return true;
+}
+
+// false when the client is gone or broke the protocol
+static bool client_read(struct client *c) {
+  ssize_t size = recv(c->fd, c->req, OPNAD_MSG_MAX, MSG_DONTWAIT | MSG_TRUNC);
+  if (size < 0) return errno == EAGAIN || errno == EINTR;
+  if (!size) return false;
+  if (size > (ssize_t)OPNAD_MSG_MAX || !request_valid(c->req, size)) {
+    return send_msg(c->fd, OPNAD_ERROR, size >= 8 ? c->req->seq : 0, 0);
+  }
+  d.batch[d.npending++] = c;
+  return true;
+}
+
+static void client_remove(unsigned i) {
+  client_free(d.client[i]);
+  d.client[i] = d.client[--d.nclients];
+}
+
+static bool listen_open(const char *path) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) return false;
+  strcpy(addr.sun_path, path);
+  d.listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  if (d.listen_fd < 0) return false;
+  // a stale socket of a previous run
+  unlink(path);
+  if (bind(d.listen_fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+      listen(d.listen_fd, 64)) {
+    close(d.listen_fd);
+    return false;
+  }
+  return true;
+}
+
+static void serve(void) {
+  static struct pollfd pfd[CLIENTS_MAX + 1];
+  while (!stop) {
+    pfd[0].fd = d.listen_fd;
+    pfd[0].events = POLLIN;
+    for (unsigned i = 0; i < d.nclients; i++) {
+      pfd[i+1].fd = d.client[i]->fd;
+      pfd[i+1].events = POLLIN;
+    }
+    unsigned npfd = d.nclients + 1;
+    if (poll(pfd, npfd, -1) < 0) {
+      if (errno == EINTR) continue;
+      perror("poll");
+      return;
+    }
+    // everything that arrived meanwhile is one batch
+    d.npending = 0;
+    for (unsigned i = npfd - 1; i > 0; i--) {
+      if (!pfd[i].revents) continue;
+      if (!client_read(d.client[i-1])) client_remove(i-1);
+    }
+    if (pfd[0].revents & POLLIN) client_accept();
+    if (!d.npending) continue;
+
+    uint64_t start = opna_prof_now();
+    render_batch();
+    d.render_ns += opna_prof_now() - start;
+    d.batches++;
+    for (unsigned i = 0; i < d.npending; i++) {
+      struct client *c = d.batch[i];
+      d.requests++;
+      d.frames += c->req->type == OPNAD_RENDER ? c->req->frames : 0;
+      if (!send_msg(c->fd, OPNAD_DONE, c->req->seq,
+                    c->req->type == OPNAD_RENDER ? c->req->frames : 0)) {
+        c->gone = true;
+      }
+    }
+    for (unsigned i = d.nclients; i--;) {
+      if (d.client[i]->gone) client_remove(i);
+    }
+  }
+}
+
+static void usage(const char *name) {
+  printf("usage: %s [-s socket] [-j workers]\n", name);
+  printf("  -s socket   path to listen on (default %s)\n", OPNAD_SOCKET);
+  printf("  -j workers  render threads (default one per cpu)\n");
+}
+
+int main(int argc, char **argv) {
+  const char *path = OPNAD_SOCKET;
+  long workers = sysconf(_SC_NPROCESSORS_ONLN);
+  int argi = 1;
+  while (argi+1 < argc && argv[argi][0] == '-') {
+    if (!strcmp(argv[argi], "-s")) {
+      path = argv[argi+1];
+    } else if (!strcmp(argv[argi], "-j")) {
+      workers = atoi(argv[argi+1]);
+      if (workers < 1) argi = argc;
+    } else {
+      break;
+    }
+    argi += 2;
+  }
+  if (argi != argc) {
+    usage(argv[0]);
+    return 1;
+  }
+  if (workers < 1) workers = 1;
+
+  int ret = 1;
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_signal;
+  sigaction(SIGINT, &sa, 0);
+  sigaction(SIGTERM, &sa, 0);
+  signal(SIGPIPE, SIG_IGN);
+
+  pthread_mutex_init(&d.mutex, 0);
+  pthread_cond_init(&d.work, 0);
+  pthread_cond_init(&d.finished, 0);
+  if (!listen_open(path)) {
+    fprintf(stderr, "cannot listen on %s\n", path);
+    return 1;
+  }
+  if (!workers_start(workers)) {
+    fprintf(stderr, "cannot start workers\n");
+    goto err_listen;
+  }
+  printf("%s: listening with %u workers\n", path, d.nworkers);
+  fflush(stdout);
+  serve();
+  workers_stop();
+  while (d.nclients) client_remove(d.nclients - 1);
+  double sec = (double)d.render_ns / 1e9;
+  double len = (double)d.frames / FM_OPNA_SAMPLERATE;
+  printf("%llu requests in %llu batches, %.1fs of audio rendered in %.2fs (%.1fx real time)\n",
+         (unsigned long long)d.requests, (unsigned long long)d.batches, len, sec,
+         sec > 0 ? len / sec : 0.0);
+  ret = 0;
+err_listen:
+  close(d.listen_fd);
+  unlink(path);
+  return ret;
+}
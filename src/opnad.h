@@ -0,0 +1,50 @@
+#ifndef OPNATEST_OPNAD_H_INCLUDED
+#define OPNATEST_OPNAD_H_INCLUDED
+
+#include <stdint.h>
+#include "opnarender.h"
+
+// protocol of opnad, a render server for clients on the same machine.
+// messages are struct opnad_msg in native byte order, one per packet of
+// a SOCK_SEQPACKET unix socket.
+//
+// on connect the server answers OPNAD_HELLO with a memfd attached to it,
+// which the client maps OPNAD_SHM_SIZE bytes of. it is sealed against
+// resizing. every client has an fm_opna of its own, reset when the
+// connection is made.
+//
+// OPNAD_RENDER carries frames and that many writes, in nondecreasing
+// order with sample < frames. the server applies each write before the
+// frame it is timestamped with and leaves frames of FM_OPNA_S16 output at
+// the start of the memfd, then answers OPNAD_DONE with the same seq.
+// OPNAD_RESET resets the fm_opna and is answered the same way. a client
+// sends its next request only after the answer to the previous one,
+// requests of all clients are rendered in batches on a pool of workers.
+// a bad request is answered with OPNAD_ERROR and changes nothing. a
+// client that does not take an answer within a second is disconnected.
+
+#define OPNAD_SOCKET "/tmp/opnad.sock"
+#define OPNAD_FRAMES_MAX 65536
+#define OPNAD_SHM_SIZE (OPNAD_FRAMES_MAX * 2 * sizeof(int16_t))
+#define OPNAD_WRITES_MAX 8192
+
+enum opnad_type {
+  OPNAD_HELLO,
+  OPNAD_RENDER,
+  OPNAD_RESET,
+  OPNAD_DONE,
+  OPNAD_ERROR,
+};
+
+struct opnad_msg {
+  uint32_t type;
+  // echoed in the answer
+  uint32_t seq;
+  uint32_t frames;
+  uint32_t writes;
+  struct opna_regwrite write[];
+};
+
+#define OPNAD_MSG_MAX (sizeof(struct opnad_msg) + OPNAD_WRITES_MAX * sizeof(struct opna_regwrite))
+
+#endif /* OPNATEST_OPNAD_H_INCLUDED */
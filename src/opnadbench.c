@@ -0,0 +1,229 @@
+// load test of opnad: clients on threads of their own play random notes
+// and check every answer against an fm_opna rendered locally
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "opnad.h"
+#include "opnabank.h"
+#include "opnaprof.h"
+#include "fnumtable.h"
+
+#define CLIENTS_MAX 1024
+// key events per request
+#define EVENTS 8
+
+static struct {
+  const char *path;
+  unsigned frames;
+  unsigned requests;
+} opt;
+
+struct bench_client {
+  pthread_t thread;
+  unsigned index;
+  uint64_t mismatches;
+  // answer latency of every request
+  struct opna_prof prof;
+  bool ok;
+};
+
+static int connect_server(int16_t **pcm) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, opt.path, sizeof(addr.sun_path) - 1);
+  int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (fd < 0) return -1;
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr))) goto err;
+  struct opnad_msg hello;
+  struct iovec iov = {&hello, sizeof(hello)};
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } ctl;
+  struct msghdr mh;
+  memset(&mh, 0, sizeof(mh));
+  mh.msg_iov = &iov;
+  mh.msg_iovlen = 1;
+  mh.msg_control = ctl.buf;
+  mh.msg_controllen = sizeof(ctl.buf);
+  if (recvmsg(fd, &mh, MSG_CMSG_CLOEXEC) != sizeof(hello) || hello.type != OPNAD_HELLO) goto err;
+  struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+  if (!cm || cm->cmsg_type != SCM_RIGHTS) goto err;
+  int shm;
+  memcpy(&shm, CMSG_DATA(cm), sizeof(int));
+  *pcm = mmap(0, OPNAD_SHM_SIZE, PROT_READ, MAP_SHARED, shm, 0);
+  close(shm);
+  if (*pcm == MAP_FAILED) goto err;
+  return fd;
+err:
+  close(fd);
+  return -1;
+}
+
+static void add_write(struct opnad_msg *req, uint32_t sample, unsigned reg, unsigned val) {
+  struct opna_regwrite *w = &req->write[req->writes++];
+  w->sample = sample;
+  w->reg = reg;
+  w->val = val;
+}
+
+// the default voice on all channels, then random key ons and offs
+static void make_request(struct opnad_msg *req, unsigned n, unsigned *seed) {
+  req->type = OPNAD_RENDER;
+  req->seq = n;
+  req->frames = opt.frames;
+  req->writes = 0;
+  if (!n) {
+    struct opna_bankpatch bp;
+    opna_bankpatch_default(&bp);
+    for (unsigned c = 0; c < 6; c++) {
+      for (int i = 0; i < OPNA_BANK_REGS; i++) {
+        add_write(req, 0, opna_bank_regaddr(c, i), bp.regs[i]);
+      }
+      add_write(req, 0, (c < 3 ? 0xb4 + c : 0x1b4 + c - 3), 0xc0);
+    }
+  }
+  uint32_t t[EVENTS];
+  for (int i = 0; i < EVENTS; i++) t[i] = rand_r(seed) % opt.frames;
+  for (int i = 1; i < EVENTS; i++) {
+    for (int j = i; j > 0 && t[j-1] > t[j]; j--) {
+      uint32_t s = t[j];
+      t[j] = t[j-1];
+      t[j-1] = s;
+    }
+  }
+  for (int i = 0; i < EVENTS; i++) {
+    unsigned c = rand_r(seed) % 6;
+    unsigned sel = c < 3 ? c : c + 1;
+    if (rand_r(seed) & 1) {
+      unsigned note = 24 + rand_r(seed) % 48;
+      unsigned fnum = fnumtable_fmp[note % 12], blk = note / 12;
+      unsigned base = c < 3 ? c : 0x100 + c - 3;
+      add_write(req, t[i], 0xa4 + base, (blk << 3) | (fnum >> 8));
+      add_write(req, t[i], 0xa0 + base, fnum & 0xff);
+      add_write(req, t[i], 0x28, sel);
+      add_write(req, t[i], 0x28, 0xf0 | sel);
+    } else {
+      add_write(req, t[i], 0x28, sel);
+    }
+  }
+}
+
+static void *client_thread(void *ptr) {
+  struct bench_client *bc = ptr;
+  int16_t *pcm;
+  int fd = connect_server(&pcm);
+  if (fd < 0) {
+    fprintf(stderr, "client %u: cannot connect to %s\n", bc->index, opt.path);
+    return 0;
+  }
+  struct opnad_msg *req = malloc(OPNAD_MSG_MAX);
+  int32_t *lbuf = malloc(sizeof(int32_t) * opt.frames * 2);
+  struct fm_opna *ref = calloc(1, sizeof(*ref));
+  if (!req || !lbuf || !ref) goto out;
+  int32_t *rbuf = lbuf + opt.frames;
+  fm_opna_reset(ref);
+  unsigned seed = bc->index + 1;
+  for (unsigned n = 0; n < opt.requests; n++) {
+    make_request(req, n, &seed);
+    size_t size = sizeof(*req) + req->writes * sizeof(struct opna_regwrite);
+    uint64_t start = opna_prof_now();
+    if (send(fd, req, size, MSG_NOSIGNAL) != (ssize_t)size) goto out;
+    struct opnad_msg ans;
+    if (recv(fd, &ans, sizeof(ans), 0) != sizeof(ans)) goto out;
+    opna_prof_record(&bc->prof, opna_prof_now() - start, opt.frames, FM_OPNA_SAMPLERATE);
+    if (ans.type != OPNAD_DONE || ans.seq != n || ans.frames != opt.frames) goto out;
+
+    memset(lbuf, 0, sizeof(int32_t) * opt.frames * 2);
+    opna_render_log(ref, req->write, req->writes, lbuf, rbuf, opt.frames);
+    for (unsigned i = 0; i < opt.frames; i++) {
+      for (int ch = 0; ch < 2; ch++) {
+        int32_t s = (ch ? rbuf : lbuf)[i] / 2;
+        if (s > INT16_MAX) s = INT16_MAX;
+        if (s < INT16_MIN) s = INT16_MIN;
+        if (pcm[2*i+ch] != s) bc->mismatches++;
+      }
+    }
+  }
+  bc->ok = true;
+out:
+  free(ref);
+  free(lbuf);
+  free(req);
+  munmap(pcm, OPNAD_SHM_SIZE);
+  close(fd);
+  return 0;
+}
+
+static void usage(const char *name) {
+  printf("usage: %s [-s socket] [-n clients] [-f frames] [-r requests]\n", name);
+  printf("  -s socket    opnad socket (default %s)\n", OPNAD_SOCKET);
+  printf("  -n clients   connections, each on a thread (default 8)\n");
+  printf("  -f frames    frames per request, 1-%d (default 1024)\n", OPNAD_FRAMES_MAX);
+  printf("  -r requests  requests per client (default 500)\n");
+}
+
+int main(int argc, char **argv) {
+  int clients = 8, frames = 1024, requests = 500;
+  opt.path = OPNAD_SOCKET;
+  int argi = 1;
+  while (argi+1 < argc && argv[argi][0] == '-') {
+    if (!strcmp(argv[argi], "-s")) {
+      opt.path = argv[argi+1];
+    } else if (!strcmp(argv[argi], "-n")) {
+      clients = atoi(argv[argi+1]);
+    } else if (!strcmp(argv[argi], "-f")) {
+      frames = atoi(argv[argi+1]);
+    } else if (!strcmp(argv[argi], "-r")) {
+      requests = atoi(argv[argi+1]);
+    } else {
+      break;
+    }
+    argi += 2;
+  }
+  if (argi != argc || clients < 1 || clients > CLIENTS_MAX ||
+      frames < 1 || frames > OPNAD_FRAMES_MAX || requests < 1) {
+    usage(argv[0]);
+    return 1;
+  }
+  opt.frames = frames;
+  opt.requests = requests;
+
+  struct bench_client *bc = calloc(clients, sizeof(*bc));
+  if (!bc) return 1;
+  uint64_t start = opna_prof_now();
+  int started = 0;
+  for (; started < clients; started++) {
+    bc[started].index = started;
+    opna_prof_reset(&bc[started].prof);
+    if (pthread_create(&bc[started].thread, 0, client_thread, &bc[started])) break;
+  }
+  for (int i = 0; i < started; i++) pthread_join(bc[i].thread, 0);
+  double sec = (double)(opna_prof_now() - start) / 1e9;
+
+  int ret = 0;
+  uint64_t mismatches = 0, worst = 0;
+  for (int i = 0; i < started; i++) {
+    struct opna_prof_stats st;
+    opna_prof_get(&bc[i].prof, &st);
+    uint64_t p99 = opna_prof_time_quantile(&st, 0.99);
+    if (p99 > worst) worst = p99;
+    mismatches += bc[i].mismatches;
+    if (!bc[i].ok) ret = 1;
+  }
+  if (started < clients) ret = 1;
+  if (mismatches) ret = 1;
+  double len = (double)frames * requests * started / FM_OPNA_SAMPLERATE;
+  printf("%d clients: %.1fs of audio in %.2fs (%.1fx real time), worst p99 latency %.2fms, "
+         "%llu mismatched samples%s\n",
+         started, len, sec, sec > 0 ? len / sec : 0.0, worst / 1e6,
+         (unsigned long long)mismatches, ret && !mismatches ? ", some clients failed" : "");
+  free(bc);
+  return ret;
+}
@@ -1,6 +1,7 @@
 #include "opnafm.h"
 
 #include "opnatables.h"
+#include "opnaprof.h"
 
 enum {
   CH3_MODE_NORMAL = 0,
@@ -8,6 +9,10 @@ enum {
   CH3_MODE_SE     = 2
 };
 
+const uint8_t fm_carriers[8] = {
+  0x8, 0x8, 0x8, 0x8, 0xa, 0xe, 0xe, 0xf
+};
+
 void fm_slot_reset(struct fm_slot *slot) {
   slot->phase = 0;
   slot->env = 1023;
@@ -42,6 +47,9 @@ void fm_chan_reset(struct fm_channel *chan) {
   chan->fb = 0;
   chan->fnum = 0;
   chan->blk = 0;
+#ifdef LIBOPNA_ENABLE_STATS
+  chan->env_transitions = 0;
+#endif
 }
 
 void fm_opna_reset(struct fm_opna *opna) {
@@ -59,6 +67,103 @@ void fm_opna_reset(struct fm_opna *opna) {
     opna->ch3.fnum[i] = 0;
     opna->ch3.blk[i] = 0;
   }
+  opna_rhythm_reset(&opna->rhythm);
+  opna->prof = 0;
+#ifdef LIBOPNA_ENABLE_STATS
+  for (int i = 0; i < 0x200; i++) opna->regs[i] = 0;
+  for (int i = 0; i < 3; i++) {
+    opna->regs[0xb4+i] = 0xc0;
+    opna->regs[0x1b4+i] = 0xc0;
+  }
+#endif
+  fm_opna_clear_stats(opna);
+}
+
+bool fm_opna_get_stats(const struct fm_opna *opna, struct fm_opna_stats *stats) {
+#ifdef LIBOPNA_ENABLE_STATS
+  *stats = opna->stats;
+  for (int c = 0; c < 6; c++) {
+    stats->env_transitions += opna->channel[c].env_transitions;
+  }
+  return true;
+#else
+  (void)opna;
+  *stats = (struct fm_opna_stats){0};
+  return false;
+#endif
+}
+
+void fm_opna_clear_stats(struct fm_opna *opna) {
+#ifdef LIBOPNA_ENABLE_STATS
+  opna->stats = (struct fm_opna_stats){0};
+  for (int c = 0; c < 6; c++) {
+    opna->channel[c].env_transitions = 0;
+  }
+#else
+  (void)opna;
+#endif
+}
+
+void fm_opna_set_prof(struct fm_opna *opna, struct opna_prof *prof) {
+  opna->prof = prof;
+}
+
+void fm_opna_set_rhythm_rom(struct fm_opna *opna, const uint8_t *rom) {
+  opna_rhythm_set_rom(&opna->rhythm, rom);
+}
+
+// FNV-1a, fed field by field so that struct padding is never hashed
+static uint64_t fm_hash(uint64_t hash, uint32_t v) {
+  for (int i = 0; i < 4; i++) {
+    hash ^= (v >> (8*i)) & 0xff;
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+static uint64_t fm_slot_hash(uint64_t h, const struct fm_slot *slot) {
+  // phase and env_count are reset on key on and the output is silent until then
+  if (slot->env_state != ENV_OFF) {
+    h = fm_hash(h, slot->phase);
+    h = fm_hash(h, (uint32_t)slot->env_count);
+  }
+  h = fm_hash(h, slot->env);
+  h = fm_hash(h, slot->env_state | (slot->rate_shifter << 8) |
+                 (slot->rate_selector << 16) | ((uint32_t)slot->rate_mul << 24));
+  h = fm_hash(h, slot->tl | (slot->sl << 8) | (slot->ar << 16) | ((uint32_t)slot->dr << 24));
+  h = fm_hash(h, slot->sr | (slot->rr << 8) | (slot->mul << 16) | ((uint32_t)slot->det << 24));
+  h = fm_hash(h, slot->ks | (slot->keycode << 8) | (slot->keyon << 16));
+  return h;
+}
+
+uint64_t fm_opna_hash(const struct fm_opna *opna) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (int c = 0; c < 6; c++) {
+    const struct fm_channel *chan = &opna->channel[c];
+    for (int i = 0; i < 4; i++) {
+      h = fm_slot_hash(h, &chan->slot[i]);
+    }
+    h = fm_hash(h, chan->fbmem1 | ((uint32_t)chan->fbmem2 << 16));
+    h = fm_hash(h, chan->alg_mem | (chan->alg << 16) | ((uint32_t)chan->fb << 24));
+    h = fm_hash(h, chan->fnum | (chan->blk << 16));
+    h = fm_hash(h, opna->lselect[c] | (opna->rselect[c] << 1));
+  }
+  h = fm_hash(h, opna->blkfnum_h | (opna->ch3.mode << 8) | (opna->env_div3 << 16));
+  for (int i = 0; i < 3; i++) {
+    h = fm_hash(h, opna->ch3.fnum[i] | (opna->ch3.blk[i] << 16));
+  }
+  const struct opna_rhythm *rhythm = &opna->rhythm;
+  h = fm_hash(h, rhythm->tl | (rhythm->div3 << 8));
+  for (int i = 0; i < OPNA_RHYTHM_NUM; i++) {
+    const struct opna_rhythm_voice *voice = &rhythm->voice[i];
+    h = fm_hash(h, voice->il | (voice->lselect << 8) | (voice->rselect << 9));
+    // everything else is set again on key on
+    if (!voice->playing) continue;
+    h = fm_hash(h, voice->addr | ((uint32_t)voice->end << 16));
+    h = fm_hash(h, (uint16_t)voice->acc | (voice->step_index << 16));
+    h = fm_hash(h, (uint16_t)voice->out);
+  }
+  return h;
 }
 #define LIBOPNA_ENABLE_HIRES
 // maximum output: 2042<<2 = 8168
@@ -238,7 +343,8 @@ static void fm_slot_setrate(struct fm_slot *slot, int status) {
   }
 }
 
-static void fm_slotenv(struct fm_slot *slot) {
+// true when env_state changed
+static bool fm_slotenv(struct fm_slot *slot) {
   slot->env_count++;
   if (!(slot->env_count & ((1<<slot->rate_shifter)-1))) {
     int rate_index = (slot->env_count >> slot->rate_shifter) & 7;
@@ -254,6 +360,7 @@ static void fm_slotenv(struct fm_slot *slot) {
         slot->env = 0;
         slot->env_state = ENV_DECAY;
         fm_slot_setrate(slot, ENV_DECAY);
+        return true;
       } else {
         slot->env = newenv;
       }
@@ -265,6 +372,7 @@ static void fm_slotenv(struct fm_slot *slot) {
       if (slot->env >= (sl << 5)) {
         slot->env_state = ENV_SUSTAIN;
         fm_slot_setrate(slot, ENV_SUSTAIN);
+        return true;
       }
       break;
     case ENV_SUSTAIN:
@@ -276,10 +384,12 @@ static void fm_slotenv(struct fm_slot *slot) {
       if (slot->env >= 1023) {
         slot->env = 1023;
         slot->env_state = ENV_OFF;
+        return true;
       }
       break;
     }
   }
+  return false;
 }
 
 void fm_slot_key(struct fm_channel *chan, int slotnum, bool keyon) {
@@ -378,10 +488,72 @@ void fm_chan_set_fb(struct fm_channel *chan, unsigned fb) {
   fb &= 0x7;
   chan->fb = fb;
 }
+
+void fm_chan_set_patch(struct fm_channel *chan, const struct fm_patch *patch) {
+  fm_chan_set_alg(chan, patch->alg);
+  fm_chan_set_fb(chan, patch->fb);
+  for (int i = 0; i < 4; i++) {
+    struct fm_slot *slot = &chan->slot[i];
+    const struct fm_patch_slot *ps = &patch->slot[i];
+    slot->ar = ps->ar & 0x1f;
+    slot->dr = ps->dr & 0x1f;
+    slot->sr = ps->sr & 0x1f;
+    slot->rr = ps->rr & 0xf;
+    slot->sl = ps->sl & 0xf;
+    slot->tl = ps->tl & 0x7f;
+    slot->ks = ps->ks & 0x3;
+    slot->mul = ps->mul & 0xf;
+    slot->det = ps->det & 0x7;
+    // the rate also depends on this channel's keycode
+    fm_slot_setrate(slot, slot->env_state);
+  }
+}
+
 //#include <stdio.h>
+#ifdef LIBOPNA_ENABLE_STATS
+static void fm_opna_stat_write(struct fm_opna *opna, unsigned reg, unsigned val) {
+  unsigned lo = reg & 0xff;
+  int class = FM_OPNA_WRITE_OTHER;
+  bool trigger = false;
+  if (reg >= 0x10 && reg < 0x20) {
+    class = FM_OPNA_WRITE_RHYTHM;
+    trigger = reg == 0x10;
+  } else if (lo == 0x28) {
+    class = FM_OPNA_WRITE_KEY;
+    trigger = true;
+  } else if (lo >= 0x20 && lo < 0x30) {
+    class = FM_OPNA_WRITE_MODE;
+  } else if (lo >= 0x30 && lo < 0xa0) {
+    class = FM_OPNA_WRITE_SLOT;
+  } else if (lo >= 0xa0 && lo < 0xb0) {
+    class = FM_OPNA_WRITE_FREQ;
+    trigger = !(lo & 0x4);
+  } else if (lo >= 0xb0 && lo < 0xb7) {
+    class = FM_OPNA_WRITE_CHANNEL;
+  }
+  opna->stats.writes[class]++;
+  if (class == FM_OPNA_WRITE_FREQ && !trigger) {
+    // the blk/fnum high latch is shared by all channels
+    if ((val & 0x3f) == opna->blkfnum_h) opna->stats.redundant++;
+  } else if (!trigger && opna->regs[reg] == val) {
+    opna->stats.redundant++;
+  }
+  opna->regs[reg] = val;
+}
+#endif
+
 void fm_opna_fmwritereg(struct fm_opna *opna, unsigned reg, unsigned val) {
   reg &= (1<<9)-1;
   val &= (1<<8)-1;
+#ifdef LIBOPNA_ENABLE_STATS
+  fm_opna_stat_write(opna, reg, val);
+#endif
+
+  if (reg < 0x20) {
+    // 0x10-0x1d: rhythm
+    if (reg >= 0x10) opna_rhythm_writereg(&opna->rhythm, reg, val);
+    return;
+  }
 
   switch (reg & 0xff) {
   case 0x27:
@@ -400,6 +572,9 @@ void fm_opna_fmwritereg(struct fm_opna *opna, unsigned reg, unsigned val) {
       if (c == 3) return;
       if (val & 0x4) c += 3;
       for (int i = 0; i < 4; i++) {
+#ifdef LIBOPNA_ENABLE_STATS
+        if ((val & (1<<(4+i))) && !opna->channel[c].slot[i].keyon) opna->stats.keyons++;
+#endif
         fm_slot_key(&opna->channel[c], i, (val & (1<<(4+i))));
       }
     }
@@ -471,23 +646,60 @@ void fm_opna_fmwritereg(struct fm_opna *opna, unsigned reg, unsigned val) {
 
 void fm_chanenv(struct fm_channel *chan) {
   for (int i = 0; i < 4; i++) {
+#ifdef LIBOPNA_ENABLE_STATS
+    chan->env_transitions += fm_slotenv(&chan->slot[i]);
+#else
     fm_slotenv(&chan->slot[i]);
+#endif
   }
 }
 
-void fm_opna_fmout(struct fm_opna *opna, int32_t *lbuf, int32_t *rbuf, unsigned len) {
+#ifdef LIBOPNA_ENABLE_STATS
+static bool fm_chan_active(const struct fm_channel *chan) {
+  for (int i = 0; i < 4; i++) {
+    if (chan->slot[i].env_state != ENV_OFF) return true;
+  }
+  return false;
+}
+#endif
+
+void fm_chan_render(struct fm_channel *chan, int32_t *buf, unsigned len, unsigned env_div3) {
+  for (unsigned i = 0; i < len; i++) {
+    if (!env_div3) {
+      fm_chanenv(chan);
+      env_div3 = 3;
+    }
+    env_div3--;
+    buf[i] += fm_chanout(chan);
+    fm_chanphase(chan);
+  }
+}
+
+void fm_opna_fmout_mask(struct fm_opna *opna, int32_t *lbuf, int32_t *rbuf, unsigned len, unsigned mask) {
+  uint64_t start = opna->prof ? opna_prof_now() : 0;
+#ifdef LIBOPNA_ENABLE_STATS
+  bool active[6];
+  for (int c = 0; c < 6; c++) active[c] = fm_chan_active(&opna->channel[c]);
+  opna->stats.samples += len;
+#endif
   for (unsigned i = 0; i < len; i++) {
     if (!opna->env_div3) {
       for (int c = 0; c < 6; c++) {
+        if (!(mask & (1<<c))) continue;
         fm_chanenv(&opna->channel[c]);
+#ifdef LIBOPNA_ENABLE_STATS
+        active[c] = fm_chan_active(&opna->channel[c]);
+#endif
       }
       opna->env_div3 = 3;
     }
     opna->env_div3--;
 
-    lbuf[i] = 0;
-    rbuf[i] = 0;
     for (int c = 0; c < 6; c++) {
+      if (!(mask & (1<<c))) continue;
+#ifdef LIBOPNA_ENABLE_STATS
+      opna->stats.active[c] += active[c];
+#endif
       int16_t o = fm_chanout(&opna->channel[c]);
       // TODO: CSM
       if (c == 2 && opna->ch3.mode != CH3_MODE_NORMAL) {
@@ -499,31 +711,192 @@ void fm_opna_fmout(struct fm_opna *opna, int32_t *lbuf, int32_t *rbuf, unsigned
       if (opna->rselect[c]) rbuf[i] += o;
     }
   }
+  if (mask & FM_OPNA_MASK_RHYTHM) {
+    opna_rhythm_mix(&opna->rhythm, lbuf, rbuf, len, 1);
+  } else {
+    opna->rhythm.div3 = (opna->rhythm.div3 + 3 - (len % 3)) % 3;
+  }
+  if (opna->prof) {
+    opna_prof_record(opna->prof, opna_prof_now() - start, len, FM_OPNA_SAMPLERATE);
+  }
 }
 
-void fm_opna_fmout2(struct fm_opna *opna, int32_t *sbuf, unsigned samples) {
-  for (unsigned i = 0; i < samples; i++) {
-    if (!opna->env_div3) {
-      for (int c = 0; c < 6; c++) {
-        fm_chanenv(&opna->channel[c]);
+void fm_opna_fmout_stems(struct fm_opna *opna, int32_t *const stem[FM_OPNA_STEMS], unsigned len, bool pan) {
+  uint64_t start = opna->prof ? opna_prof_now() : 0;
+  // channels do not depend on each other, so each one runs through the whole block
+  for (int c = 0; c < 6; c++) {
+    struct fm_channel *chan = &opna->channel[c];
+    int32_t *buf = stem[c];
+    bool se = c == 2 && opna->ch3.mode != CH3_MODE_NORMAL;
+    bool l = opna->lselect[c], r = opna->rselect[c];
+    unsigned env_div3 = opna->env_div3;
+#ifdef LIBOPNA_ENABLE_STATS
+    bool active = fm_chan_active(chan);
+#endif
+    for (unsigned i = 0; i < len; i++) {
+      if (!env_div3) {
+        fm_chanenv(chan);
+#ifdef LIBOPNA_ENABLE_STATS
+        active = fm_chan_active(chan);
+#endif
+        env_div3 = 3;
+      }
+      env_div3--;
+#ifdef LIBOPNA_ENABLE_STATS
+      opna->stats.active[c] += active;
+#endif
+      int16_t o = fm_chanout(chan);
+      if (se) {
+        fm_chanphase_se(chan, opna);
+      } else {
+        fm_chanphase(chan);
+      }
+      if (!buf) continue;
+      if (pan) {
+        buf[2*i+0] = l ? o : 0;
+        buf[2*i+1] = r ? o : 0;
+      } else {
+        buf[i] = o;
       }
-      opna->env_div3 = 3;
     }
-    opna->env_div3--;
+  }
+  opna->env_div3 = (opna->env_div3 + 3 - (len % 3)) % 3;
+#ifdef LIBOPNA_ENABLE_STATS
+  opna->stats.samples += len;
+#endif
+  int32_t *rbuf = stem[FM_OPNA_STEMS-1];
+  if (rbuf) {
+    for (unsigned i = 0; i < len*2; i++) rbuf[i] = 0;
+    opna_rhythm_mix(&opna->rhythm, rbuf, rbuf+1, len, 2);
+  } else {
+    opna->rhythm.div3 = (opna->rhythm.div3 + 3 - (len % 3)) % 3;
+  }
+  if (opna->prof) {
+    opna_prof_record(opna->prof, opna_prof_now() - start, len, FM_OPNA_SAMPLERATE);
+  }
+}
 
-    sbuf[2*i+0] = 0;
-    sbuf[2*i+1] = 0;
+// frames of rhythm mixed ahead of the fm loop, small enough to stay in l1
+#define RENDER_CHUNK 64
 
-    for (int c = 0; c < 6; c++) {
-      int16_t o = fm_chanout(&opna->channel[c]);
-      // TODO: CSM
-      if (c == 2 && opna->ch3.mode != CH3_MODE_NORMAL) {
-        fm_chanphase_se(&opna->channel[c], opna);
-      } else {
-        fm_chanphase(&opna->channel[c]);
+static inline int32_t clip16(int32_t s) {
+  s /= 2;
+  if (s > INT16_MAX) s = INT16_MAX;
+  if (s < INT16_MIN) s = INT16_MIN;
+  return s;
+}
+
+static inline void fm_store(enum fm_opna_format fmt, void *buf, void *rbuf,
+                            unsigned i, int32_t l, int32_t r) {
+  switch (fmt) {
+  case FM_OPNA_S32_PLANAR:
+    ((int32_t *)buf)[i] = l;
+    ((int32_t *)rbuf)[i] = r;
+    break;
+  case FM_OPNA_S32:
+    ((int32_t *)buf)[2*i+0] = l;
+    ((int32_t *)buf)[2*i+1] = r;
+    break;
+  case FM_OPNA_S16:
+    ((int16_t *)buf)[2*i+0] = clip16(l);
+    ((int16_t *)buf)[2*i+1] = clip16(r);
+    break;
+  case FM_OPNA_S16_MONO:
+    ((int16_t *)buf)[i] = clip16((l + r) / 2);
+    break;
+  case FM_OPNA_F32:
+    ((float *)buf)[2*i+0] = clip16(l) / 32768.0f;
+    ((float *)buf)[2*i+1] = clip16(r) / 32768.0f;
+    break;
+  }
+}
+
+// fmt is a constant in every caller, so each format gets its own loop
+static inline __attribute__((always_inline))
+void fm_render_core(struct fm_opna *opna, enum fm_opna_format fmt,
+                    void *buf, void *rbuf, unsigned len) {
+  int32_t lmask[6], rmask[6];
+  for (int c = 0; c < 6; c++) {
+    lmask[c] = opna->lselect[c] ? -1 : 0;
+    rmask[c] = opna->rselect[c] ? -1 : 0;
+  }
+  bool se = opna->ch3.mode != CH3_MODE_NORMAL;
+#ifdef LIBOPNA_ENABLE_STATS
+  bool active[6];
+  for (int c = 0; c < 6; c++) active[c] = fm_chan_active(&opna->channel[c]);
+  opna->stats.samples += len;
+#endif
+  int32_t lrhythm[RENDER_CHUNK], rrhythm[RENDER_CHUNK];
+  for (unsigned done = 0; done < len;) {
+    unsigned n = len - done;
+    if (n > RENDER_CHUNK) n = RENDER_CHUNK;
+    for (unsigned i = 0; i < n; i++) {
+      lrhythm[i] = 0;
+      rrhythm[i] = 0;
+    }
+    opna_rhythm_mix(&opna->rhythm, lrhythm, rrhythm, n, 1);
+    for (unsigned i = 0; i < n; i++) {
+      if (!opna->env_div3) {
+        for (int c = 0; c < 6; c++) {
+          fm_chanenv(&opna->channel[c]);
+#ifdef LIBOPNA_ENABLE_STATS
+          active[c] = fm_chan_active(&opna->channel[c]);
+#endif
+        }
+        opna->env_div3 = 3;
       }
-      if (opna->lselect[c]) sbuf[2*i+0] += o;
-      if (opna->rselect[c]) sbuf[2*i+1] += o;
+      opna->env_div3--;
+
+      int32_t l = lrhythm[i], r = rrhythm[i];
+      for (int c = 0; c < 6; c++) {
+#ifdef LIBOPNA_ENABLE_STATS
+        opna->stats.active[c] += active[c];
+#endif
+        int32_t o = fm_chanout(&opna->channel[c]);
+        // TODO: CSM
+        if (c == 2 && se) {
+          fm_chanphase_se(&opna->channel[c], opna);
+        } else {
+          fm_chanphase(&opna->channel[c]);
+        }
+        l += o & lmask[c];
+        r += o & rmask[c];
+      }
+      fm_store(fmt, buf, rbuf, done+i, l, r);
     }
+    done += n;
   }
 }
+
+void fm_opna_render(struct fm_opna *opna, enum fm_opna_format fmt,
+                    void *buf, void *rbuf, unsigned len) {
+  uint64_t start = opna->prof ? opna_prof_now() : 0;
+  switch (fmt) {
+  case FM_OPNA_S32_PLANAR:
+    fm_render_core(opna, FM_OPNA_S32_PLANAR, buf, rbuf, len);
+    break;
+  case FM_OPNA_S32:
+    fm_render_core(opna, FM_OPNA_S32, buf, 0, len);
+    break;
+  case FM_OPNA_S16:
+    fm_render_core(opna, FM_OPNA_S16, buf, 0, len);
+    break;
+  case FM_OPNA_S16_MONO:
+    fm_render_core(opna, FM_OPNA_S16_MONO, buf, 0, len);
+    break;
+  case FM_OPNA_F32:
+    fm_render_core(opna, FM_OPNA_F32, buf, 0, len);
+    break;
+  }
+  if (opna->prof) {
+    opna_prof_record(opna->prof, opna_prof_now() - start, len, FM_OPNA_SAMPLERATE);
+  }
+}
+
+void fm_opna_fmout(struct fm_opna *opna, int32_t *lbuf, int32_t *rbuf, unsigned len) {
+  fm_opna_render(opna, FM_OPNA_S32_PLANAR, lbuf, rbuf, len);
+}
+
+void fm_opna_fmout2(struct fm_opna *opna, int32_t *sbuf, unsigned samples) {
+  fm_opna_render(opna, FM_OPNA_S32, sbuf, 0, samples);
+}
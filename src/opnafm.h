@@ -3,11 +3,17 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include "opnarhythm.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+struct opna_prof;
+
+// 7987200Hz / 144
+#define FM_OPNA_SAMPLERATE 55467
+
 enum {
   ENV_ATTACK,
   ENV_DECAY,
@@ -57,6 +63,53 @@ struct fm_channel {
   uint8_t fb;
   uint16_t fnum;
   uint8_t blk;
+
+#ifdef LIBOPNA_ENABLE_STATS
+  // attack to decay, decay to sustain and release to off in fm_chanenv
+  uint64_t env_transitions;
+#endif
+};
+
+// register values of one channel without pitch, e.g. an editor voice
+struct fm_patch {
+  uint8_t alg;
+  uint8_t fb;
+  struct fm_patch_slot {
+    uint8_t ar;
+    uint8_t dr;
+    uint8_t sr;
+    uint8_t rr;
+    uint8_t sl;
+    uint8_t tl;
+    uint8_t ks;
+    uint8_t mul;
+    uint8_t det;
+  } slot[4];
+};
+
+// register write classes of struct fm_opna_stats
+enum {
+  FM_OPNA_WRITE_RHYTHM,   // 0x10-0x1f
+  FM_OPNA_WRITE_MODE,     // 0x20-0x2f except 0x28
+  FM_OPNA_WRITE_KEY,      // 0x28
+  FM_OPNA_WRITE_SLOT,     // 0x30-0x9f
+  FM_OPNA_WRITE_FREQ,     // 0xa0-0xaf
+  FM_OPNA_WRITE_CHANNEL,  // 0xb0-0xb6
+  FM_OPNA_WRITE_OTHER,    // ssg, adpcm and unused
+  FM_OPNA_WRITE_CLASSES
+};
+
+struct fm_opna_stats {
+  uint64_t samples;
+  // samples with at least one slot not in ENV_OFF
+  uint64_t active[6];
+  uint64_t env_transitions;
+  // slots that went from off to attack
+  uint64_t keyons;
+  uint64_t writes[FM_OPNA_WRITE_CLASSES];
+  // writes of the value a register already held, key and fnum low
+  // writes are never counted since they act even when repeated
+  uint64_t redundant;
 };
 
 struct fm_opna {
@@ -79,12 +132,59 @@ struct fm_opna {
   // pan
   bool lselect[6];
   bool rselect[6];
+
+  struct opna_rhythm rhythm;
+
+  // optional, see opnaprof.h
+  struct opna_prof *prof;
+
+#ifdef LIBOPNA_ENABLE_STATS
+  struct fm_opna_stats stats;
+  // last value written to every address
+  uint8_t regs[0x200];
+#endif
 };
 
 void fm_opna_reset(struct fm_opna *opna);
 void fm_opna_fmout(struct fm_opna *opna, int32_t *lbuf, int32_t *rbuf, unsigned len);
 void fm_opna_fmout2(struct fm_opna *opna, int32_t *sbuf, unsigned samples);
+enum fm_opna_format {
+  // int32 lbuf and rbuf, unscaled
+  FM_OPNA_S32_PLANAR,
+  // interleaved int32, unscaled
+  FM_OPNA_S32,
+  // interleaved int16, halved and clipped
+  FM_OPNA_S16,
+  // int16, average of left and right, halved and clipped
+  FM_OPNA_S16_MONO,
+  // interleaved float, FM_OPNA_S16 scaled to -1.0 - 1.0
+  FM_OPNA_F32,
+};
+// len frames of fmt into buf, rbuf is only used by FM_OPNA_S32_PLANAR
+void fm_opna_render(struct fm_opna *opna, enum fm_opna_format fmt,
+                    void *buf, void *rbuf, unsigned len);
+// bit 0-5: fm channel, bit 6: rhythm
+#define FM_OPNA_MASK_RHYTHM (1u<<6)
+#define FM_OPNA_MASK_ALL 0x7fu
+// adds output of the channels in mask to lbuf/rbuf, other channels are not updated
+void fm_opna_fmout_mask(struct fm_opna *opna, int32_t *lbuf, int32_t *rbuf, unsigned len, unsigned mask);
+// stem[0-5]: fm channel, len samples, or len stereo frames with pan applied when pan.
+// stem[6]: rhythm, always len stereo frames. NULL stems are updated but not written.
+#define FM_OPNA_STEMS 7
+void fm_opna_fmout_stems(struct fm_opna *opna, int32_t *const stem[FM_OPNA_STEMS], unsigned len, bool pan);
 void fm_opna_fmwritereg(struct fm_opna *opna, unsigned reg, unsigned val);
+// call after fm_opna_reset, see opna_rhythm_set_rom
+void fm_opna_set_rhythm_rom(struct fm_opna *opna, const uint8_t *rom);
+// time every fm_opna_fmout* call into prof, call after fm_opna_reset
+void fm_opna_set_prof(struct fm_opna *opna, struct opna_prof *prof);
+// counters since fm_opna_reset or fm_opna_clear_stats. they are only kept
+// when every file including opnafm.h is built with -DLIBOPNA_ENABLE_STATS,
+// otherwise stats is zeroed and false is returned.
+bool fm_opna_get_stats(const struct fm_opna *opna, struct fm_opna_stats *stats);
+void fm_opna_clear_stats(struct fm_opna *opna);
+// hash of the state that affects future output, equal hashes mean the
+// output repeats for the same register writes. the rom pointer is not included.
+uint64_t fm_opna_hash(const struct fm_opna *opna);
 
 //
 void fm_chan_reset(struct fm_channel *chan);
@@ -92,8 +192,16 @@ void fm_chanphase(struct fm_channel *chan);
 void fm_chanenv(struct fm_channel *chan);
 void fm_chan_set_blkfnum(struct fm_channel *chan, unsigned blk, unsigned fnum);
 int16_t fm_chanout(struct fm_channel *chan);
+// adds len samples of one channel to buf, env_div3 as in struct fm_opna
+// at the first sample. keeps the channel in cache for the whole block.
+void fm_chan_render(struct fm_channel *chan, int32_t *buf, unsigned len, unsigned env_div3);
 void fm_slot_key(struct fm_channel *chan, int slotnum, bool keyon);
 
+// slot bits (1 << slot) that reach the output for each algorithm
+extern const uint8_t fm_carriers[8];
+
+// all of patch at once, envelopes keep running
+void fm_chan_set_patch(struct fm_channel *chan, const struct fm_patch *patch);
 void fm_chan_set_alg(struct fm_channel *chan, unsigned alg);
 void fm_chan_set_fb(struct fm_channel *chan, unsigned fb);
 void fm_slot_set_ar(struct fm_slot *slot, unsigned ar);
@@ -0,0 +1,379 @@
+#include "opnamidi.h"
+#include "fnumtable.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+enum {
+  // status of a tempo meta event in the merged list
+  EV_TEMPO = 0xff,
+  DRUM_CHANNEL = 9,
+};
+
+struct midi_event {
+  uint32_t tick;
+  // file order, keeps events at the same tick in order
+  uint32_t seq;
+  uint32_t tempo;
+  uint8_t status;
+  uint8_t a;
+  uint8_t b;
+};
+
+struct midi_events {
+  struct midi_event *ev;
+  size_t count;
+  size_t capacity;
+};
+
+struct midi_chan {
+  uint8_t program;
+  uint8_t volume;
+  uint8_t expression;
+  uint8_t pan;
+};
+
+struct midi_fmchan {
+  bool on;
+  uint8_t mch;
+  uint8_t note;
+  // key on/off order, the oldest is reused first
+  uint32_t age;
+  // what the registers hold now, -1 when nothing was written
+  int program;
+  int att;
+  uint8_t pan;
+};
+
+struct midi_conv {
+  struct opna_midi *midi;
+  bool ok;
+  const struct opna_bank *bank;
+  struct opna_bankpatch builtin;
+  struct midi_chan mch[16];
+  struct midi_fmchan fm[6];
+  uint32_t serial;
+};
+
+static uint32_t be32(const uint8_t *p) {
+  return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static unsigned be16(const uint8_t *p) {
+  return (p[0] << 8) | p[1];
+}
+
+static bool read_varlen(const uint8_t **p, const uint8_t *end, uint32_t *v) {
+  uint32_t r = 0;
+  for (int i = 0; i < 4; i++) {
+    if (*p >= end) return false;
+    uint8_t c = *(*p)++;
+    r = (r << 7) | (c & 0x7f);
+    if (!(c & 0x80)) {
+      *v = r;
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool events_push(struct midi_events *evs, uint32_t tick,
+                        unsigned status, unsigned a, unsigned b, uint32_t tempo) {
+  if (evs->count == evs->capacity) {
+    size_t capacity = evs->capacity ? evs->capacity * 2 : 1024;
+    struct midi_event *ev = realloc(evs->ev, sizeof(*ev) * capacity);
+    if (!ev) return false;
+    evs->ev = ev;
+    evs->capacity = capacity;
+  }
+  struct midi_event *e = &evs->ev[evs->count];
+  e->tick = tick;
+  e->seq = evs->count++;
+  e->tempo = tempo;
+  e->status = status;
+  e->a = a;
+  e->b = b;
+  return true;
+}
+
+static bool parse_track(struct midi_events *evs, const uint8_t *p, const uint8_t *end) {
+  uint32_t tick = 0;
+  uint8_t running = 0;
+  while (p < end) {
+    uint32_t delta, len;
+    if (!read_varlen(&p, end, &delta)) return false;
+    tick += delta;
+    if (p >= end) return false;
+    uint8_t status = *p;
+    if (status & 0x80) {
+      p++;
+    } else {
+      if (!running) return false;
+      status = running;
+    }
+    if (status == 0xff) {
+      if (p >= end) return false;
+      uint8_t type = *p++;
+      if (!read_varlen(&p, end, &len) || len > (size_t)(end - p)) return false;
+      // end of track
+      if (type == 0x2f) return true;
+      if (type == 0x51 && len == 3) {
+        uint32_t tempo = (p[0] << 16) | (p[1] << 8) | p[2];
+        if (tempo && !events_push(evs, tick, EV_TEMPO, 0, 0, tempo)) return false;
+      }
+      p += len;
+      running = 0;
+      continue;
+    }
+    if (status == 0xf0 || status == 0xf7) {
+      if (!read_varlen(&p, end, &len) || len > (size_t)(end - p)) return false;
+      p += len;
+      running = 0;
+      continue;
+    }
+    if (status > 0xf0) return false;
+    running = status;
+    // program change and channel pressure have one data byte
+    unsigned n = ((status & 0xe0) == 0xc0) ? 1 : 2;
+    if ((size_t)(end - p) < n) return false;
+    uint8_t a = p[0];
+    uint8_t b = n == 2 ? p[1] : 0;
+    if ((a | b) & 0x80) return false;
+    p += n;
+    if (!events_push(evs, tick, status, a, b, 0)) return false;
+  }
+  return true;
+}
+
+static int event_cmp(const void *pa, const void *pb) {
+  const struct midi_event *a = pa, *b = pb;
+  if (a->tick != b->tick) return a->tick < b->tick ? -1 : 1;
+  return a->seq < b->seq ? -1 : (a->seq > b->seq);
+}
+
+static void emit(struct midi_conv *cv, uint32_t sample, unsigned reg, unsigned val) {
+  struct opna_midi *midi = cv->midi;
+  if (!cv->ok) return;
+  if (midi->writes == midi->capacity) {
+    size_t capacity = midi->capacity ? midi->capacity * 2 : 4096;
+    struct opna_regwrite *log = realloc(midi->log, sizeof(*log) * capacity);
+    if (!log) {
+      cv->ok = false;
+      return;
+    }
+    midi->log = log;
+    midi->capacity = capacity;
+  }
+  struct opna_regwrite *w = &midi->log[midi->writes++];
+  w->sample = sample;
+  w->reg = reg;
+  w->val = val;
+}
+
+static unsigned fm_base(int c) {
+  return c < 3 ? c : 0x100 + (c - 3);
+}
+
+static unsigned fm_keysel(int c) {
+  return c < 3 ? c : c + 1;
+}
+
+// the pre-decoded block of the program, carrier tl raised by att
+static void write_patch(struct midi_conv *cv, uint32_t sample, int c, int program, int att) {
+  const struct opna_bankpatch *bp = &cv->builtin;
+  if (cv->bank && cv->bank->count) bp = &cv->bank->patch[program % cv->bank->count];
+  uint8_t regs[OPNA_BANK_REGS];
+  opna_bankpatch_attenuate(bp, att, regs);
+  for (int i = 0; i < OPNA_BANK_REGS; i++) {
+    emit(cv, sample, opna_bank_regaddr(c, i), regs[i]);
+  }
+  cv->fm[c].program = program;
+  cv->fm[c].att = att;
+}
+
+static void note_off(struct midi_conv *cv, uint32_t sample, unsigned mch, unsigned note) {
+  for (int c = 0; c < 6; c++) {
+    struct midi_fmchan *fm = &cv->fm[c];
+    if (!fm->on || fm->mch != mch || fm->note != note) continue;
+    emit(cv, sample, 0x28, fm_keysel(c));
+    fm->on = false;
+    fm->age = cv->serial++;
+  }
+}
+
+static void all_off(struct midi_conv *cv, uint32_t sample, unsigned mch) {
+  for (int c = 0; c < 6; c++) {
+    if (cv->fm[c].on && cv->fm[c].mch == mch) note_off(cv, sample, mch, cv->fm[c].note);
+  }
+}
+
+static void note_on(struct midi_conv *cv, uint32_t sample,
+                    unsigned mch, unsigned note, unsigned vel) {
+  const struct midi_chan *ch = &cv->mch[mch];
+  note_off(cv, sample, mch, note);
+
+  // free channel already holding the program, any free one, the oldest note
+  int c = -1;
+  for (int pass = 0; pass < 3 && c < 0; pass++) {
+    for (int i = 0; i < 6; i++) {
+      const struct midi_fmchan *fm = &cv->fm[i];
+      if (pass < 2 && fm->on) continue;
+      if (pass == 0 && fm->program != ch->program) continue;
+      if (c < 0 || (int32_t)(fm->age - cv->fm[c].age) < 0) c = i;
+    }
+  }
+  struct midi_fmchan *fm = &cv->fm[c];
+  if (fm->on) emit(cv, sample, 0x28, fm_keysel(c));
+
+  int att = (127 - vel) / 4 + (127 - ch->volume) / 4 + (127 - ch->expression) / 4;
+  if (fm->program != ch->program || fm->att != att) write_patch(cv, sample, c, ch->program, att);
+  uint8_t pan = ch->pan < 43 ? 0x80 : ch->pan > 85 ? 0x40 : 0xc0;
+  if (fm->pan != pan) {
+    emit(cv, sample, fm_base(c) + 0xb4, pan);
+    fm->pan = pan;
+  }
+
+  // same octave mapping as the editor keyboard
+  int blk = (int)note / 12 - 1;
+  if (blk < 0) blk = 0;
+  if (blk > 7) blk = 7;
+  unsigned fnum = fnumtable_fmp[note % 12];
+  emit(cv, sample, fm_base(c) + 0xa4, (blk << 3) | (fnum >> 8));
+  emit(cv, sample, fm_base(c) + 0xa0, fnum & 0xff);
+  emit(cv, sample, 0x28, 0xf0 | fm_keysel(c));
+  fm->on = true;
+  fm->mch = mch;
+  fm->note = note;
+  fm->age = cv->serial++;
+}
+
+static void channel_event(struct midi_conv *cv, uint32_t sample, const struct midi_event *e) {
+  unsigned mch = e->status & 0xf;
+  if (mch == DRUM_CHANNEL) return;
+  struct midi_chan *ch = &cv->mch[mch];
+  switch (e->status & 0xf0) {
+  case 0x80:
+    note_off(cv, sample, mch, e->a);
+    break;
+  case 0x90:
+    if (e->b) note_on(cv, sample, mch, e->a, e->b);
+    else note_off(cv, sample, mch, e->a);
+    break;
+  case 0xb0:
+    switch (e->a) {
+    case 7:
+      ch->volume = e->b;
+      break;
+    case 10:
+      ch->pan = e->b;
+      break;
+    case 11:
+      ch->expression = e->b;
+      break;
+    // all sound off, all notes off
+    case 120:
+    case 123:
+      all_off(cv, sample, mch);
+      break;
+    }
+    break;
+  case 0xc0:
+    ch->program = e->a;
+    break;
+  }
+}
+
+bool opna_midi_convert(struct opna_midi *midi, const uint8_t *smf, size_t size,
+                       const struct opna_bank *bank) {
+  memset(midi, 0, sizeof(*midi));
+  struct midi_events evs = {0};
+  struct midi_conv *cv = 0;
+  const uint8_t *p = smf, *end = smf + size;
+
+  if (size < 14 || memcmp(p, "MThd", 4)) goto err;
+  uint32_t hlen = be32(p+4);
+  if (hlen < 6 || hlen > size - 8) goto err;
+  unsigned ntracks = be16(p+10);
+  unsigned division = be16(p+12);
+  if (!division) goto err;
+  p += 8 + hlen;
+  for (unsigned t = 0; t < ntracks && end - p >= 8;) {
+    uint32_t len = be32(p+4);
+    if (len > (size_t)(end - p) - 8) goto err;
+    if (!memcmp(p, "MTrk", 4)) {
+      if (!parse_track(&evs, p+8, p+8+len)) goto err;
+      t++;
+    }
+    p += 8 + len;
+  }
+  if (evs.count) qsort(evs.ev, evs.count, sizeof(*evs.ev), event_cmp);
+
+  // sample = ticks * spt_num / spt_den, tempo changes rebase
+  uint64_t spt_num, spt_den;
+  if (division & 0x8000) {
+    unsigned fps = 256 - (division >> 8);
+    unsigned tpf = division & 0xff;
+    if (!fps || !tpf) goto err;
+    // 29 means 29.97 drop frame
+    spt_num = (uint64_t)FM_OPNA_SAMPLERATE * (fps == 29 ? 1001 : 1);
+    spt_den = (uint64_t)tpf * (fps == 29 ? 30000 : fps);
+  } else {
+    spt_num = (uint64_t)FM_OPNA_SAMPLERATE * 500000;
+    spt_den = (uint64_t)division * 1000000;
+  }
+
+  cv = calloc(1, sizeof(*cv));
+  if (!cv) goto err;
+  cv->midi = midi;
+  cv->ok = true;
+  cv->bank = bank;
+  opna_bankpatch_default(&cv->builtin);
+  for (int i = 0; i < 16; i++) {
+    cv->mch[i].volume = 100;
+    cv->mch[i].expression = 127;
+    cv->mch[i].pan = 64;
+  }
+  for (int c = 0; c < 6; c++) {
+    cv->fm[c].program = -1;
+    cv->fm[c].att = -1;
+    // fm_opna_reset pans to both
+    cv->fm[c].pan = 0xc0;
+  }
+
+  uint64_t base_sample = 0;
+  uint32_t base_tick = 0;
+  uint32_t sample = 0;
+  for (size_t i = 0; i < evs.count && cv->ok; i++) {
+    const struct midi_event *e = &evs.ev[i];
+    uint64_t s = base_sample + (uint64_t)(e->tick - base_tick) * spt_num / spt_den;
+    if (s > UINT32_MAX - FM_OPNA_SAMPLERATE) break;
+    sample = s;
+    if (e->status == EV_TEMPO) {
+      if (division & 0x8000) continue;
+      // rebase so the rounding does not accumulate
+      base_sample = s;
+      base_tick = e->tick;
+      spt_num = (uint64_t)FM_OPNA_SAMPLERATE * e->tempo;
+      continue;
+    }
+    channel_event(cv, sample, e);
+  }
+  if (!cv->ok) goto err;
+  midi->samples = sample + FM_OPNA_SAMPLERATE;
+  free(cv);
+  free(evs.ev);
+  return true;
+err:
+  free(cv);
+  free(evs.ev);
+  opna_midi_free(midi);
+  return false;
+}
+
+void opna_midi_free(struct opna_midi *midi) {
+  free(midi->log);
+  midi->log = 0;
+  midi->writes = 0;
+  midi->capacity = 0;
+  midi->samples = 0;
+}
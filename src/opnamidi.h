@@ -0,0 +1,31 @@
+#ifndef LIBOPNA_OPNAMIDI_H_INCLUDED
+#define LIBOPNA_OPNAMIDI_H_INCLUDED
+
+#include "opnarender.h"
+#include "opnabank.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// a standard midi file converted to sample-exact register writes for the
+// six fm channels. channel 10 (drums) and pitch bend are ignored.
+struct opna_midi {
+  struct opna_regwrite *log;
+  size_t writes;
+  size_t capacity;
+  // last event plus one second of release
+  uint32_t samples;
+};
+
+// program n plays bank patch n % count, a built-in patch when bank is NULL
+// or empty. velocity, volume (cc7) and expression (cc11) attenuate the carriers.
+bool opna_midi_convert(struct opna_midi *midi, const uint8_t *smf, size_t size,
+                       const struct opna_bank *bank);
+void opna_midi_free(struct opna_midi *midi);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBOPNA_OPNAMIDI_H_INCLUDED */
@@ -0,0 +1,554 @@
+#include "opnamml.h"
+#include "fnumtable.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// bytecode, lengths are 1 byte below 0x80, else 0x80|hi, lo
+enum {
+  // 0x00-0x5f note (octave*12 + semitone), length
+  OP_REST = 0x60,       // length
+  // 0x80-0xdf note without key on after a slur, length
+  OP_LEGATO = 0x80,
+  OP_VOICE = 0xe0,      // u16
+  OP_VOLUME = 0xe1,     // u8
+  OP_DETUNE = 0xe2,     // s16
+  OP_GATE = 0xe3,       // u8
+  OP_PAN = 0xe4,        // u8, 0xb4 bits
+  OP_TEMPO = 0xe5,      // u8, timer b
+  OP_RPT_BEGIN = 0xe6,
+  OP_RPT_END = 0xe7,    // u8 count, u16 back to after OP_RPT_BEGIN
+  OP_RPT_BREAK = 0xe8,  // u16 forward to OP_RPT_END
+  OP_END = 0xff,
+};
+
+#define NOTE_NUM 96
+#define LEN_MAX 0x7fff
+#define RPT_DEPTH 4
+// commands run per tick without reaching a note or rest before a part is stopped
+#define EXEC_MAX 256
+
+struct mml_part {
+  uint8_t *code;
+  size_t size;
+  size_t capacity;
+  bool used;
+  int octave;
+  unsigned len;
+  bool slur;
+  uint32_t loop;
+  int rpt_depth;
+  // offset after OP_RPT_BEGIN and of OP_RPT_BREAK, 0 if none
+  size_t rpt[RPT_DEPTH];
+  size_t brk[RPT_DEPTH];
+};
+
+struct mml_cc {
+  struct mml_part part[OPNA_MML_PARTS];
+  bool ok;
+};
+
+static void put(struct mml_cc *cc, struct mml_part *p, unsigned byte) {
+  if (!cc->ok) return;
+  if (p->size == p->capacity) {
+    size_t capacity = p->capacity ? p->capacity * 2 : 256;
+    uint8_t *code = realloc(p->code, capacity);
+    if (!code) {
+      cc->ok = false;
+      return;
+    }
+    p->code = code;
+    p->capacity = capacity;
+  }
+  p->code[p->size++] = byte;
+}
+
+static void put16(struct mml_cc *cc, struct mml_part *p, unsigned v) {
+  put(cc, p, v & 0xff);
+  put(cc, p, (v >> 8) & 0xff);
+}
+
+static void putlen(struct mml_cc *cc, struct mml_part *p, unsigned len) {
+  if (len >= 0x80) put(cc, p, 0x80 | (len >> 8));
+  put(cc, p, len & 0xff);
+}
+
+static bool read_num(const char **s, int *v) {
+  const char *t = *s;
+  bool neg = *t == '-';
+  if (neg) t++;
+  if (*t < '0' || *t > '9') return false;
+  int n = 0;
+  while (*t >= '0' && *t <= '9' && n < 100000) n = n*10 + (*t++ - '0');
+  *v = neg ? -n : n;
+  *s = t;
+  return true;
+}
+
+// note value with dots, %ticks, or the default length
+static bool read_len(const char **s, unsigned def, unsigned *len) {
+  int n;
+  unsigned base;
+  if (**s == '%') {
+    (*s)++;
+    if (!read_num(s, &n) || n <= 0) return false;
+    base = n;
+  } else if (read_num(s, &n)) {
+    if (n <= 0 || OPNA_MML_WHOLE % n) return false;
+    base = OPNA_MML_WHOLE / n;
+  } else {
+    base = def;
+  }
+  unsigned total = base;
+  while (**s == '.') {
+    (*s)++;
+    if (base % 2) return false;
+    base /= 2;
+    total += base;
+  }
+  if (!total || total > LEN_MAX) return false;
+  *len = total;
+  return true;
+}
+
+static int semitone(char c) {
+  static const int st[7] = {9, 11, 0, 2, 4, 5, 7};
+  return st[c - 'a'];
+}
+
+static unsigned bpm_to_tb(int bpm) {
+  // a quarter is OPNA_MML_WHOLE/4 ticks of (256 - tb) * 8 samples
+  long t = ((long)FM_OPNA_SAMPLERATE * 60 * 2 / (bpm * (OPNA_MML_WHOLE/4) * 8) + 1) / 2;
+  if (t < 1) t = 1;
+  if (t > 256) t = 256;
+  return 256 - t;
+}
+
+// one line of mml into one part
+static bool compile_line(struct mml_cc *cc, struct mml_part *p, const char *s, const char *end) {
+  int n;
+  unsigned len;
+  p->used = true;
+  while (s < end && cc->ok) {
+    char c = *s++;
+    switch (c) {
+    case ' ':
+    case '\t':
+    case '\r':
+    case '|':
+      break;
+    case 'c': case 'd': case 'e': case 'f': case 'g': case 'a': case 'b':
+      {
+        int note = p->octave * 12 + semitone(c);
+        while (s < end && (*s == '+' || *s == '#' || *s == '-')) {
+          note += *s++ == '-' ? -1 : 1;
+        }
+        if (!read_len(&s, p->len, &len)) return false;
+        while (s < end && *s == '^') {
+          unsigned tie;
+          s++;
+          if (!read_len(&s, p->len, &tie) || len + tie > LEN_MAX) return false;
+          len += tie;
+        }
+        if (note < 0 || note >= NOTE_NUM) return false;
+        put(cc, p, (p->slur ? OP_LEGATO : 0) + note);
+        putlen(cc, p, len);
+        p->slur = s < end && *s == '&';
+        if (p->slur) s++;
+      }
+      break;
+    case 'r':
+      if (!read_len(&s, p->len, &len)) return false;
+      while (s < end && *s == '^') {
+        unsigned tie;
+        s++;
+        if (!read_len(&s, p->len, &tie) || len + tie > LEN_MAX) return false;
+        len += tie;
+      }
+      put(cc, p, OP_REST);
+      putlen(cc, p, len);
+      p->slur = false;
+      break;
+    case 'o':
+      if (!read_num(&s, &n) || n < 0 || n > 7) return false;
+      p->octave = n;
+      break;
+    case '>':
+      if (++p->octave > 7) return false;
+      break;
+    case '<':
+      if (--p->octave < 0) return false;
+      break;
+    case 'l':
+      if (!read_len(&s, p->len, &len)) return false;
+      p->len = len;
+      break;
+    case 'v':
+      if (!read_num(&s, &n) || n < 0 || n > 15) return false;
+      put(cc, p, OP_VOLUME);
+      put(cc, p, n);
+      break;
+    case 'D':
+      if (!read_num(&s, &n) || n < -0x7ff || n > 0x7ff) return false;
+      put(cc, p, OP_DETUNE);
+      put16(cc, p, n & 0xffff);
+      break;
+    case '@':
+      if (!read_num(&s, &n) || n < 0 || n > 0xffff) return false;
+      put(cc, p, OP_VOICE);
+      put16(cc, p, n);
+      break;
+    case 'q':
+      if (!read_num(&s, &n) || n < 0 || n > 8) return false;
+      put(cc, p, OP_GATE);
+      put(cc, p, n);
+      break;
+    case 'p':
+      if (!read_num(&s, &n) || n < 1 || n > 3) return false;
+      put(cc, p, OP_PAN);
+      put(cc, p, (n & 1 ? 0x40 : 0) | (n & 2 ? 0x80 : 0));
+      break;
+    case 't':
+      if (!read_num(&s, &n) || n <= 0) return false;
+      put(cc, p, OP_TEMPO);
+      put(cc, p, bpm_to_tb(n));
+      break;
+    case 'T':
+      if (!read_num(&s, &n) || n < 0 || n > 255) return false;
+      put(cc, p, OP_TEMPO);
+      put(cc, p, n);
+      break;
+    case 'L':
+      if (p->rpt_depth) return false;
+      p->loop = p->size;
+      break;
+    case '[':
+      if (p->rpt_depth == RPT_DEPTH) return false;
+      put(cc, p, OP_RPT_BEGIN);
+      p->rpt[p->rpt_depth] = p->size;
+      p->brk[p->rpt_depth] = 0;
+      p->rpt_depth++;
+      break;
+    case ':':
+      if (!p->rpt_depth || p->brk[p->rpt_depth-1]) return false;
+      p->brk[p->rpt_depth-1] = p->size;
+      put(cc, p, OP_RPT_BREAK);
+      put16(cc, p, 0);
+      break;
+    case ']':
+      {
+        if (!p->rpt_depth) return false;
+        if (!read_num(&s, &n)) n = 2;
+        if (n < 1 || n > 255) return false;
+        p->rpt_depth--;
+        size_t at = p->size;
+        size_t back = at - p->rpt[p->rpt_depth];
+        size_t brk = p->brk[p->rpt_depth];
+        if (back > 0xffff) return false;
+        put(cc, p, OP_RPT_END);
+        put(cc, p, n);
+        put16(cc, p, back);
+        if (brk && cc->ok) {
+          p->code[brk+1] = (at - brk) & 0xff;
+          p->code[brk+2] = (at - brk) >> 8;
+        }
+      }
+      break;
+    case ';':
+      return true;
+    default:
+      return false;
+    }
+  }
+  return true;
+}
+
+bool opna_mml_compile(struct opna_mml *mml, const char *text) {
+  memset(mml, 0, sizeof(*mml));
+  struct mml_cc cc = {0};
+  cc.ok = true;
+  for (int i = 0; i < OPNA_MML_PARTS; i++) {
+    cc.part[i].octave = 4;
+    cc.part[i].len = OPNA_MML_WHOLE / 4;
+    cc.part[i].loop = OPNA_MML_NONE;
+  }
+
+  unsigned line = 0;
+  for (const char *s = text; *s;) {
+    const char *end = strchr(s, '\n');
+    if (!end) end = s + strlen(s);
+    line++;
+    const char *t = s;
+    while (t < end && *t >= 'A' && *t < 'A' + OPNA_MML_PARTS) t++;
+    // anything else is a comment or header line
+    if (t > s && t < end && (*t == ' ' || *t == '\t')) {
+      for (const char *c = s; c < t; c++) {
+        if (!compile_line(&cc, &cc.part[*c - 'A'], t, end)) goto err;
+      }
+    }
+    if (!cc.ok) goto err;
+    s = *end ? end + 1 : end;
+  }
+
+  size_t size = 0;
+  for (int i = 0; i < OPNA_MML_PARTS; i++) {
+    struct mml_part *p = &cc.part[i];
+    if (!p->used) continue;
+    if (p->rpt_depth) goto err;
+    put(&cc, p, OP_END);
+    size += p->size;
+  }
+  if (!cc.ok) goto err;
+  mml->code = malloc(size ? size : 1);
+  if (!mml->code) goto err;
+  for (int i = 0; i < OPNA_MML_PARTS; i++) {
+    struct mml_part *p = &cc.part[i];
+    mml->part[i] = OPNA_MML_NONE;
+    mml->loop[i] = OPNA_MML_NONE;
+    if (!p->used) continue;
+    memcpy(mml->code + mml->size, p->code, p->size);
+    mml->part[i] = mml->size;
+    if (p->loop != OPNA_MML_NONE) mml->loop[i] = mml->size + p->loop;
+    mml->size += p->size;
+  }
+  for (int i = 0; i < OPNA_MML_PARTS; i++) free(cc.part[i].code);
+  return true;
+err:
+  for (int i = 0; i < OPNA_MML_PARTS; i++) free(cc.part[i].code);
+  opna_mml_free(mml);
+  mml->errline = line;
+  return false;
+}
+
+void opna_mml_free(struct opna_mml *mml) {
+  free(mml->code);
+  mml->code = 0;
+  mml->size = 0;
+  for (int i = 0; i < OPNA_MML_PARTS; i++) {
+    mml->part[i] = OPNA_MML_NONE;
+    mml->loop[i] = OPNA_MML_NONE;
+  }
+}
+
+void opna_mmldrv_init(struct opna_mmldrv *drv, const struct opna_mml *mml,
+                      const struct opna_bank *bank) {
+  memset(drv, 0, sizeof(*drv));
+  drv->mml = mml;
+  drv->bank = bank;
+  drv->tb = bpm_to_tb(120);
+  drv->playing = false;
+  for (int i = 0; i < OPNA_MML_PARTS; i++) {
+    struct opna_mmlpart *p = &drv->part[i];
+    p->pc = mml->part[i];
+    p->gate = 8;
+    p->volume = 12;
+    p->pan = 0xc0;
+    p->loaded_voice = -1;
+    p->loaded_att = -1;
+    // fm_opna_reset pans to both
+    p->loaded_pan = 0xc0;
+    if (p->pc != OPNA_MML_NONE) drv->playing = true;
+  }
+}
+
+static unsigned fm_base(int c) {
+  return c < 3 ? c : 0x100 + (c - 3);
+}
+
+static unsigned fm_keysel(int c) {
+  return c < 3 ? c : c + 1;
+}
+
+static unsigned read16(const uint8_t *p) {
+  return p[0] | (p[1] << 8);
+}
+
+static unsigned readlen(const uint8_t *code, uint32_t *pc) {
+  unsigned len = code[(*pc)++];
+  if (len & 0x80) len = ((len & 0x7f) << 8) | code[(*pc)++];
+  return len;
+}
+
+static void part_keyoff(struct opna_mmlpart *p, struct fm_opna *opna, int c) {
+  if (!p->keyon) return;
+  fm_opna_fmwritereg(opna, 0x28, fm_keysel(c));
+  p->keyon = false;
+}
+
+static void part_load(struct opna_mmldrv *drv, struct opna_mmlpart *p,
+                      struct fm_opna *opna, int c) {
+  int att = (15 - p->volume) * 4;
+  if (p->loaded_voice != p->voice || p->loaded_att != att) {
+    struct opna_bankpatch def;
+    const struct opna_bankpatch *bp;
+    if (drv->bank && drv->bank->count) {
+      bp = &drv->bank->patch[p->voice % drv->bank->count];
+    } else {
+      opna_bankpatch_default(&def);
+      bp = &def;
+    }
+    uint8_t regs[OPNA_BANK_REGS];
+    opna_bankpatch_attenuate(bp, att, regs);
+    for (int i = 0; i < OPNA_BANK_REGS; i++) {
+      fm_opna_fmwritereg(opna, opna_bank_regaddr(c, i), regs[i]);
+    }
+    p->loaded_voice = p->voice;
+    p->loaded_att = att;
+  }
+  if (p->loaded_pan != p->pan) {
+    fm_opna_fmwritereg(opna, fm_base(c) + 0xb4, p->pan);
+    p->loaded_pan = p->pan;
+  }
+}
+
+static void part_note(struct opna_mmldrv *drv, struct opna_mmlpart *p,
+                      struct fm_opna *opna, int c, unsigned op, unsigned len) {
+  bool legato = op >= OP_LEGATO && p->keyon;
+  unsigned note = op & 0x7f;
+  if (!legato) {
+    part_keyoff(p, opna, c);
+    part_load(drv, p, opna, c);
+  }
+  int fnum = fnumtable_fmp[note % 12] + p->detune;
+  if (fnum < 0) fnum = 0;
+  if (fnum > 0x7ff) fnum = 0x7ff;
+  fm_opna_fmwritereg(opna, fm_base(c) + 0xa4, ((note / 12) << 3) | (fnum >> 8));
+  fm_opna_fmwritereg(opna, fm_base(c) + 0xa0, fnum & 0xff);
+  if (!legato) fm_opna_fmwritereg(opna, 0x28, 0xf0 | fm_keysel(c));
+  p->keyon = true;
+  p->wait = len;
+  p->gate_off = 0;
+  // held into a following slurred note
+  uint8_t next = drv->mml->code[p->pc];
+  if (next >= OP_LEGATO && next < OP_VOICE) return;
+  if (p->gate < 8) {
+    unsigned g = len * p->gate / 8;
+    p->gate_off = g ? g : 1;
+  }
+}
+
+static void part_exec(struct opna_mmldrv *drv, struct opna_mmlpart *p,
+                      struct fm_opna *opna, int c) {
+  const uint8_t *code = drv->mml->code;
+  for (int n = 0; n < EXEC_MAX; n++) {
+    unsigned op = code[p->pc++];
+    if (op < OP_REST || (op >= OP_LEGATO && op < OP_VOICE)) {
+      unsigned len = readlen(code, &p->pc);
+      part_note(drv, p, opna, c, op, len);
+      return;
+    }
+    switch (op) {
+    case OP_REST:
+      part_keyoff(p, opna, c);
+      p->wait = readlen(code, &p->pc);
+      p->gate_off = 0;
+      return;
+    case OP_VOICE:
+      p->voice = read16(code + p->pc);
+      p->pc += 2;
+      break;
+    case OP_VOLUME:
+      p->volume = code[p->pc++];
+      break;
+    case OP_DETUNE:
+      p->detune = (int16_t)read16(code + p->pc);
+      p->pc += 2;
+      break;
+    case OP_GATE:
+      p->gate = code[p->pc++];
+      break;
+    case OP_PAN:
+      p->pan = code[p->pc++];
+      break;
+    case OP_TEMPO:
+      drv->tb = code[p->pc++];
+      break;
+    case OP_RPT_BEGIN:
+      if (p->rpt_depth < RPT_DEPTH) p->rpt[p->rpt_depth++] = 0;
+      break;
+    case OP_RPT_END:
+      {
+        uint32_t at = p->pc - 1;
+        unsigned count = code[p->pc];
+        if (p->rpt_depth && ++p->rpt[p->rpt_depth-1] < count) {
+          p->pc = at - read16(code + at + 2);
+        } else {
+          if (p->rpt_depth) p->rpt_depth--;
+          p->pc += 3;
+        }
+      }
+      break;
+    case OP_RPT_BREAK:
+      {
+        uint32_t at = p->pc - 1;
+        uint32_t end = at + read16(code + p->pc);
+        p->pc += 2;
+        // last pass: leave the repeat here
+        if (p->rpt_depth && p->rpt[p->rpt_depth-1] + 1 >= code[end+1]) {
+          p->rpt_depth--;
+          p->pc = end + 4;
+        }
+      }
+      break;
+    case OP_END:
+    default:
+      if (op == OP_END && drv->mml->loop[c] != OPNA_MML_NONE) {
+        p->pc = drv->mml->loop[c];
+        break;
+      }
+      part_keyoff(p, opna, c);
+      p->pc = OPNA_MML_NONE;
+      return;
+    }
+  }
+  // a loop without notes or rests
+  part_keyoff(p, opna, c);
+  p->pc = OPNA_MML_NONE;
+}
+
+void opna_mmldrv_tick(struct opna_mmldrv *drv, struct fm_opna *opna) {
+  bool playing = false;
+  for (int c = 0; c < OPNA_MML_PARTS; c++) {
+    struct opna_mmlpart *p = &drv->part[c];
+    if (p->pc == OPNA_MML_NONE) continue;
+    if (p->gate_off && !--p->gate_off) part_keyoff(p, opna, c);
+    if (p->wait) p->wait--;
+    if (!p->wait) part_exec(drv, p, opna, c);
+    if (p->pc != OPNA_MML_NONE) playing = true;
+  }
+  drv->playing = playing;
+}
+
+static size_t frame_size(enum fm_opna_format fmt) {
+  switch (fmt) {
+  case FM_OPNA_S32_PLANAR:
+    return sizeof(int32_t);
+  case FM_OPNA_S32:
+    return 2 * sizeof(int32_t);
+  case FM_OPNA_S16:
+    return 2 * sizeof(int16_t);
+  case FM_OPNA_S16_MONO:
+    return sizeof(int16_t);
+  case FM_OPNA_F32:
+    return 2 * sizeof(float);
+  }
+  return 0;
+}
+
+void opna_mmldrv_render(struct opna_mmldrv *drv, struct fm_opna *opna,
+                        enum fm_opna_format fmt, void *buf, void *rbuf, unsigned frames) {
+  size_t size = frame_size(fmt);
+  unsigned done = 0;
+  while (done < frames) {
+    if (!drv->until_tick) {
+      opna_mmldrv_tick(drv, opna);
+      drv->until_tick = (256 - drv->tb) * 8;
+    }
+    unsigned len = frames - done;
+    if (len > drv->until_tick) len = drv->until_tick;
+    fm_opna_render(opna, fmt, (uint8_t *)buf + done * size,
+                   rbuf ? (uint8_t *)rbuf + done * sizeof(int32_t) : 0, len);
+    done += len;
+    drv->until_tick -= len;
+  }
+}
@@ -0,0 +1,82 @@
+#ifndef LIBOPNA_OPNAMML_H_INCLUDED
+#define LIBOPNA_OPNAMML_H_INCLUDED
+
+#include "opnabank.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define OPNA_MML_PARTS 6
+#define OPNA_MML_NONE 0xffffffffu
+// ticks per whole note
+#define OPNA_MML_WHOLE 96
+
+// compiled song, read only while playing and shared by any number of drivers
+struct opna_mml {
+  uint8_t *code;
+  size_t size;
+  // start and L loop point of parts A-F, OPNA_MML_NONE if absent
+  uint32_t part[OPNA_MML_PARTS];
+  uint32_t loop[OPNA_MML_PARTS];
+  // 1-based line of the first error when compiling fails
+  unsigned errline;
+};
+
+// lines start with the parts they belong to, e.g. "AB o4 l8 cdef", ';' comments.
+// c d e f g a b (+ # - accidentals), r, length as note value with dots or
+// %ticks, ^ tie, & slur, o < > octave, l default length, v0-15 volume,
+// D detune in fnum steps, @ voice, q0-8 gate, p1-3 pan (right, left, both),
+// t bpm or T timer-b value (global), L loop point, [ ... : ... ]n repeat.
+bool opna_mml_compile(struct opna_mml *mml, const char *text);
+void opna_mml_free(struct opna_mml *mml);
+
+struct opna_mmlpart {
+  // OPNA_MML_NONE when finished
+  uint32_t pc;
+  // ticks until the next command
+  uint16_t wait;
+  // ticks until key off, 0 when none is due
+  uint16_t gate_off;
+  uint8_t gate;
+  uint8_t volume;
+  uint8_t pan;
+  bool keyon;
+  int16_t detune;
+  uint16_t voice;
+  // what the registers hold, -1 when nothing was written
+  int16_t loaded_voice;
+  int16_t loaded_att;
+  uint8_t loaded_pan;
+  uint8_t rpt_depth;
+  uint8_t rpt[4];
+};
+
+// one playing instance, small enough to run thousands against one song
+struct opna_mmldrv {
+  const struct opna_mml *mml;
+  // NULL for the default voice
+  const struct opna_bank *bank;
+  struct opna_mmlpart part[OPNA_MML_PARTS];
+  // timer b, a tick is (256 - tb) * 8 samples
+  uint8_t tb;
+  // samples until the next tick
+  uint32_t until_tick;
+  // false once every part without a loop point has ended
+  bool playing;
+};
+
+void opna_mmldrv_init(struct opna_mmldrv *drv, const struct opna_mml *mml,
+                      const struct opna_bank *bank);
+// one timer b tick, register writes go to opna
+void opna_mmldrv_tick(struct opna_mmldrv *drv, struct fm_opna *opna);
+// ticks as due and renders the spans between them straight into buf in
+// fmt, see fm_opna_render
+void opna_mmldrv_render(struct opna_mmldrv *drv, struct fm_opna *opna,
+                        enum fm_opna_format fmt, void *buf, void *rbuf, unsigned frames);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBOPNA_OPNAMML_H_INCLUDED */
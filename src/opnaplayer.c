@@ -0,0 +1,314 @@
+#include "opnaplayer.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SEEKINDEX_MAGIC "OPNASEEK"
+
+bool opna_seekindex_init(struct opna_seekindex *index, uint32_t interval) {
+  index->cp = 0;
+  index->count = 0;
+  index->capacity = 0;
+  index->interval = interval;
+  return interval != 0;
+}
+
+void opna_seekindex_free(struct opna_seekindex *index) {
+  free(index->cp);
+  index->cp = 0;
+  index->count = 0;
+  index->capacity = 0;
+}
+
+static bool opna_seekindex_add(struct opna_seekindex *index,
+                               const struct opna_player *player) {
+  if (index->count == index->capacity) {
+    size_t capacity = index->capacity ? index->capacity * 2 : 64;
+    struct opna_checkpoint *cp = realloc(index->cp, sizeof(*cp) * capacity);
+    if (!cp) return false;
+    index->cp = cp;
+    index->capacity = capacity;
+  }
+  struct opna_checkpoint *cp = &index->cp[index->count++];
+  cp->sample = player->sample;
+  cp->logpos = player->logpos;
+  cp->opna = player->opna;
+  return true;
+}
+
+// last checkpoint at or before sample
+static const struct opna_checkpoint *opna_seekindex_find(
+    const struct opna_seekindex *index, uint32_t sample) {
+  size_t lo = 0, hi = index->count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (index->cp[mid].sample <= sample) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo ? &index->cp[lo-1] : 0;
+}
+
+struct seekindex_header {
+  char magic[8];
+  uint32_t statesize;
+  uint32_t interval;
+  uint64_t count;
+};
+
+bool opna_seekindex_save(const struct opna_seekindex *index, const char *path) {
+  FILE *f = fopen(path, "wb");
+  if (!f) return false;
+  struct seekindex_header h = {0};
+  memcpy(h.magic, SEEKINDEX_MAGIC, 8);
+  h.statesize = sizeof(struct opna_checkpoint);
+  h.interval = index->interval;
+  h.count = index->count;
+  bool ok = fwrite(&h, sizeof(h), 1, f) == 1;
+  for (size_t i = 0; ok && i < index->count; i++) {
+    // pointers mean nothing in another process, restore keeps the live ones
+    struct opna_checkpoint cp = index->cp[i];
+    cp.opna.rhythm.rom = 0;
+    cp.opna.prof = 0;
+    ok = fwrite(&cp, sizeof(cp), 1, f) == 1;
+  }
+  if (fclose(f)) ok = false;
+  return ok;
+}
+
+bool opna_seekindex_load(struct opna_seekindex *index, const char *path) {
+  FILE *f = fopen(path, "rb");
+  if (!f) return false;
+  struct seekindex_header h;
+  if (fread(&h, sizeof(h), 1, f) != 1) goto err;
+  if (memcmp(h.magic, SEEKINDEX_MAGIC, 8)) goto err;
+  if (h.statesize != sizeof(struct opna_checkpoint)) goto err;
+  if (!h.interval) goto err;
+  // count comes from the file, it must fit both the file and size_t
+  // before it sizes the allocation
+  if (fseek(f, 0, SEEK_END)) goto err;
+  long end = ftell(f);
+  if (end < (long)sizeof(h) || fseek(f, sizeof(h), SEEK_SET)) goto err;
+  struct opna_checkpoint *cp = 0;
+  if (h.count > (uint64_t)(end - sizeof(h)) / sizeof(*cp)) goto err;
+  if (h.count > SIZE_MAX / sizeof(*cp)) goto err;
+  if (h.count) {
+    cp = malloc(sizeof(*cp) * h.count);
+    if (!cp) goto err;
+    if (fread(cp, sizeof(*cp), h.count, f) != h.count) {
+      free(cp);
+      goto err;
+    }
+  }
+  fclose(f);
+  opna_seekindex_free(index);
+  index->cp = cp;
+  index->count = h.count;
+  index->capacity = h.count;
+  index->interval = h.interval;
+  return true;
+err:
+  fclose(f);
+  return false;
+}
+
+bool opna_loopcache_init(struct opna_loopcache *cache, uint32_t max) {
+  cache->lbuf = malloc(sizeof(int32_t) * max);
+  cache->rbuf = malloc(sizeof(int32_t) * max);
+  cache->max = max;
+  cache->hash = 0;
+  cache->recording = false;
+  cache->complete = false;
+  cache->serving = false;
+  if (!cache->lbuf || !cache->rbuf) {
+    opna_loopcache_free(cache);
+    return false;
+  }
+  return true;
+}
+
+void opna_loopcache_free(struct opna_loopcache *cache) {
+  free(cache->lbuf);
+  free(cache->rbuf);
+  cache->lbuf = 0;
+  cache->rbuf = 0;
+  cache->max = 0;
+  cache->recording = false;
+  cache->complete = false;
+  cache->serving = false;
+}
+
+void opna_player_init(struct opna_player *player, const struct fm_opna *opna,
+                      const struct opna_regwrite *log, size_t writes,
+                      struct opna_seekindex *index) {
+  player->opna = *opna;
+  player->init = *opna;
+  player->log = log;
+  player->writes = writes;
+  player->logpos = 0;
+  player->sample = 0;
+  player->index = index;
+  player->loop_start = 0;
+  player->loop_end = 0;
+  player->loop_logpos = 0;
+  player->cache = 0;
+}
+
+bool opna_player_set_loop(struct opna_player *player,
+                          uint32_t loop_start, uint32_t loop_end,
+                          struct opna_loopcache *cache) {
+  if (loop_end && loop_end <= loop_start) return false;
+  size_t lo = 0, hi = player->writes;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (player->log[mid].sample < loop_start) lo = mid + 1;
+    else hi = mid;
+  }
+  player->loop_start = loop_start;
+  player->loop_end = loop_end;
+  player->loop_logpos = lo;
+  player->cache = cache;
+  if (cache) {
+    cache->recording = false;
+    cache->complete = false;
+    cache->serving = false;
+  }
+  return true;
+}
+
+// called at the loop start before the writes there are applied
+static void opna_player_loopstart(struct opna_player *player) {
+  struct opna_loopcache *cache = player->cache;
+  if (!cache) return;
+  uint64_t hash = fm_opna_hash(&player->opna);
+  if (cache->complete && cache->hash == hash) {
+    // same state as the recorded pass, so the output repeats from here
+    cache->serving = true;
+    return;
+  }
+  cache->complete = false;
+  cache->recording = (player->loop_end - player->loop_start) <= cache->max;
+  cache->hash = hash;
+}
+
+static void opna_player_loopend(struct opna_player *player) {
+  struct opna_loopcache *cache = player->cache;
+  if (cache && cache->recording) {
+    cache->recording = false;
+    cache->complete = true;
+  }
+  player->sample = player->loop_start;
+  player->logpos = player->loop_logpos;
+}
+
+static unsigned opna_player_serve(struct opna_player *player,
+                                  int32_t *lbuf, int32_t *rbuf, unsigned samples) {
+  const struct opna_loopcache *cache = player->cache;
+  uint32_t offset = player->sample - player->loop_start;
+  unsigned len = player->loop_end - player->sample;
+  if (len > samples) len = samples;
+  memcpy(lbuf, cache->lbuf + offset, sizeof(int32_t) * len);
+  memcpy(rbuf, cache->rbuf + offset, sizeof(int32_t) * len);
+  player->sample += len;
+  return len;
+}
+
+static void opna_player_checkpoint(struct opna_player *player) {
+  struct opna_seekindex *index = player->index;
+  if (!index) return;
+  if (player->sample % index->interval) return;
+  if (index->count && index->cp[index->count-1].sample >= player->sample) return;
+  opna_seekindex_add(index, player);
+}
+
+void opna_player_render(struct opna_player *player,
+                        int32_t *lbuf, int32_t *rbuf, unsigned samples) {
+  struct opna_loopcache *cache = player->cache;
+  unsigned done = 0;
+  while (done < samples) {
+    if (player->loop_end) {
+      if (player->sample == player->loop_end) opna_player_loopend(player);
+      if (player->sample == player->loop_start && !(cache && cache->serving)) {
+        opna_player_loopstart(player);
+      }
+      if (cache && cache->serving) {
+        done += opna_player_serve(player, lbuf+done, rbuf+done, samples-done);
+        continue;
+      }
+    }
+    opna_player_checkpoint(player);
+    while (player->logpos < player->writes &&
+           player->log[player->logpos].sample <= player->sample) {
+      const struct opna_regwrite *w = &player->log[player->logpos++];
+      fm_opna_fmwritereg(&player->opna, w->reg, w->val);
+    }
+    uint32_t next = player->sample + (samples - done);
+    if (player->logpos < player->writes &&
+        player->log[player->logpos].sample < next) {
+      next = player->log[player->logpos].sample;
+    }
+    if (player->index) {
+      uint32_t interval = player->index->interval;
+      uint32_t boundary = (player->sample / interval + 1) * interval;
+      if (boundary < next) next = boundary;
+    }
+    if (player->loop_end) {
+      if (player->sample < player->loop_start && player->loop_start < next) {
+        next = player->loop_start;
+      }
+      if (player->loop_end < next) next = player->loop_end;
+    }
+    unsigned len = next - player->sample;
+    fm_opna_fmout(&player->opna, lbuf+done, rbuf+done, len);
+    if (cache && cache->recording) {
+      uint32_t offset = player->sample - player->loop_start;
+      memcpy(cache->lbuf + offset, lbuf+done, sizeof(int32_t) * len);
+      memcpy(cache->rbuf + offset, rbuf+done, sizeof(int32_t) * len);
+    }
+    done += len;
+    player->sample = next;
+  }
+}
+
+static void opna_player_restore(struct opna_player *player,
+                                const struct fm_opna *opna,
+                                uint32_t sample, size_t logpos) {
+  // keep the rom and profiler of the running chip, the saved pointers
+  // may be stale or were zeroed on save
+  const uint8_t *rom = player->opna.rhythm.rom;
+  struct opna_prof *prof = player->opna.prof;
+  player->opna = *opna;
+  player->opna.rhythm.rom = rom;
+  player->opna.prof = prof;
+  player->sample = sample;
+  player->logpos = logpos;
+}
+
+void opna_player_seek(struct opna_player *player, uint32_t sample) {
+  if (player->loop_end && sample >= player->loop_end) {
+    uint32_t loop_len = player->loop_end - player->loop_start;
+    sample = player->loop_start + (sample - player->loop_start) % loop_len;
+  }
+  // the chip does not advance while the loop cache is served
+  bool stale = false;
+  if (player->cache) {
+    stale = player->cache->serving;
+    player->cache->serving = false;
+    player->cache->recording = false;
+  }
+  const struct opna_checkpoint *cp = 0;
+  if (player->index) cp = opna_seekindex_find(player->index, sample);
+  if (cp && (stale || cp->sample > player->sample || sample < player->sample)) {
+    opna_player_restore(player, &cp->opna, cp->sample, cp->logpos);
+  } else if (stale || sample < player->sample) {
+    opna_player_restore(player, &player->init, 0, 0);
+  }
+
+  int32_t lbuf[1024], rbuf[1024];
+  while (player->sample < sample) {
+    unsigned len = sample - player->sample;
+    if (len > 1024) len = 1024;
+    opna_player_render(player, lbuf, rbuf, len);
+  }
+}
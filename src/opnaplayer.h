@@ -0,0 +1,88 @@
+#ifndef LIBOPNA_OPNAPLAYER_H_INCLUDED
+#define LIBOPNA_OPNAPLAYER_H_INCLUDED
+
+#include "opnarender.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct opna_checkpoint {
+  // playback position in samples
+  uint32_t sample;
+  // index of the first log entry not applied yet
+  size_t logpos;
+  struct fm_opna opna;
+};
+
+struct opna_seekindex {
+  struct opna_checkpoint *cp;
+  size_t count;
+  size_t capacity;
+  // samples between checkpoints
+  uint32_t interval;
+};
+
+// PCM of one pass through the loop, served instead of re-rendering
+// once the chip state at the loop start repeats
+struct opna_loopcache {
+  int32_t *lbuf;
+  int32_t *rbuf;
+  // capacity in samples, longer loops are never cached
+  uint32_t max;
+  // fm_opna_hash at the loop start of the recorded pass
+  uint64_t hash;
+  bool recording;
+  bool complete;
+  bool serving;
+};
+
+struct opna_player {
+  struct fm_opna opna;
+  // state at sample 0, used when seeking without an index
+  struct fm_opna init;
+  const struct opna_regwrite *log;
+  size_t writes;
+  size_t logpos;
+  uint32_t sample;
+  // optional, filled while playing
+  struct opna_seekindex *index;
+  // loop, disabled when loop_end is 0
+  uint32_t loop_start;
+  uint32_t loop_end;
+  size_t loop_logpos;
+  // optional
+  struct opna_loopcache *cache;
+};
+
+// interval: e.g. 5*FM_OPNA_SAMPLERATE for every 5 seconds
+bool opna_seekindex_init(struct opna_seekindex *index, uint32_t interval);
+void opna_seekindex_free(struct opna_seekindex *index);
+// the file is only valid for the same build and register log
+bool opna_seekindex_save(const struct opna_seekindex *index, const char *path);
+bool opna_seekindex_load(struct opna_seekindex *index, const char *path);
+
+bool opna_loopcache_init(struct opna_loopcache *cache, uint32_t max);
+void opna_loopcache_free(struct opna_loopcache *cache);
+
+// opna is the state at the start of the log
+void opna_player_init(struct opna_player *player, const struct fm_opna *opna,
+                      const struct opna_regwrite *log, size_t writes,
+                      struct opna_seekindex *index);
+void opna_player_render(struct opna_player *player,
+                        int32_t *lbuf, int32_t *rbuf, unsigned samples);
+// jump back to loop_start when loop_end is reached, writes at or after
+// loop_end are never applied. loop_end 0 disables the loop, otherwise it
+// must be after loop_start or false is returned and nothing changes.
+// cache may be NULL.
+bool opna_player_set_loop(struct opna_player *player,
+                          uint32_t loop_start, uint32_t loop_end,
+                          struct opna_loopcache *cache);
+// restores the nearest checkpoint at or before sample and renders the rest
+void opna_player_seek(struct opna_player *player, uint32_t sample);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBOPNA_OPNAPLAYER_H_INCLUDED */
@@ -0,0 +1,93 @@
+#include "opnaprof.h"
+
+#include <time.h>
+
+void opna_prof_reset(struct opna_prof *prof) {
+  atomic_store(&prof->calls, 0);
+  atomic_store(&prof->samples, 0);
+  atomic_store(&prof->total_ns, 0);
+  atomic_store(&prof->max_ns, 0);
+  atomic_store(&prof->overruns, 0);
+  for (int i = 0; i < OPNA_PROF_TIME_BUCKETS; i++) {
+    atomic_store(&prof->time_hist[i], 0);
+  }
+  for (int i = 0; i < OPNA_PROF_RATIO_BUCKETS; i++) {
+    atomic_store(&prof->ratio_hist[i], 0);
+  }
+}
+
+uint64_t opna_prof_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+void opna_prof_record(struct opna_prof *prof, uint64_t ns, unsigned samples, unsigned rate) {
+  atomic_fetch_add_explicit(&prof->calls, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&prof->samples, samples, memory_order_relaxed);
+  atomic_fetch_add_explicit(&prof->total_ns, ns, memory_order_relaxed);
+  uint64_t max = atomic_load_explicit(&prof->max_ns, memory_order_relaxed);
+  while (ns > max) {
+    if (atomic_compare_exchange_weak_explicit(&prof->max_ns, &max, ns,
+                                              memory_order_relaxed,
+                                              memory_order_relaxed)) break;
+  }
+
+  int tb = 0;
+  while (tb < OPNA_PROF_TIME_BUCKETS-1 && (ns >> (tb+1))) tb++;
+  atomic_fetch_add_explicit(&prof->time_hist[tb], 1, memory_order_relaxed);
+
+  uint64_t period_ns = (uint64_t)samples * 1000000000u / rate;
+  if (!period_ns) return;
+  uint64_t rb = ns * OPNA_PROF_RATIO_STEP / period_ns;
+  if (rb > OPNA_PROF_RATIO_BUCKETS-1) rb = OPNA_PROF_RATIO_BUCKETS-1;
+  atomic_fetch_add_explicit(&prof->ratio_hist[rb], 1, memory_order_relaxed);
+  if (ns > period_ns) {
+    atomic_fetch_add_explicit(&prof->overruns, 1, memory_order_relaxed);
+  }
+}
+
+void opna_prof_get(struct opna_prof *prof, struct opna_prof_stats *stats) {
+  stats->calls = atomic_load_explicit(&prof->calls, memory_order_relaxed);
+  stats->samples = atomic_load_explicit(&prof->samples, memory_order_relaxed);
+  stats->total_ns = atomic_load_explicit(&prof->total_ns, memory_order_relaxed);
+  stats->max_ns = atomic_load_explicit(&prof->max_ns, memory_order_relaxed);
+  stats->overruns = atomic_load_explicit(&prof->overruns, memory_order_relaxed);
+  for (int i = 0; i < OPNA_PROF_TIME_BUCKETS; i++) {
+    stats->time_hist[i] = atomic_load_explicit(&prof->time_hist[i], memory_order_relaxed);
+  }
+  for (int i = 0; i < OPNA_PROF_RATIO_BUCKETS; i++) {
+    stats->ratio_hist[i] = atomic_load_explicit(&prof->ratio_hist[i], memory_order_relaxed);
+  }
+}
+
+double opna_prof_ns_per_sample(const struct opna_prof_stats *stats) {
+  if (!stats->samples) return 0.0;
+  return (double)stats->total_ns / stats->samples;
+}
+
+static int opna_prof_quantile_bucket(const uint32_t *hist, int buckets, double p) {
+  uint64_t total = 0;
+  for (int i = 0; i < buckets; i++) total += hist[i];
+  if (!total) return -1;
+  uint64_t target = (uint64_t)(p * total);
+  if (target >= total) target = total - 1;
+  uint64_t sum = 0;
+  for (int i = 0; i < buckets; i++) {
+    sum += hist[i];
+    if (sum > target) return i;
+  }
+  return buckets - 1;
+}
+
+uint64_t opna_prof_time_quantile(const struct opna_prof_stats *stats, double p) {
+  int b = opna_prof_quantile_bucket(stats->time_hist, OPNA_PROF_TIME_BUCKETS, p);
+  if (b < 0) return 0;
+  return (uint64_t)1 << (b+1);
+}
+
+double opna_prof_ratio_quantile(const struct opna_prof_stats *stats, double p) {
+  int b = opna_prof_quantile_bucket(stats->ratio_hist, OPNA_PROF_RATIO_BUCKETS, p);
+  if (b < 0) return 0.0;
+  return (double)(b+1) / OPNA_PROF_RATIO_STEP;
+}
@@ -0,0 +1,57 @@
+#ifndef LIBOPNA_OPNAPROF_H_INCLUDED
+#define LIBOPNA_OPNAPROF_H_INCLUDED
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// call wall time, bucket i counts [2^i, 2^(i+1)) ns
+#define OPNA_PROF_TIME_BUCKETS 32
+// wall time / buffer period, bucket i counts [i/16, (i+1)/16), last one everything above
+#define OPNA_PROF_RATIO_BUCKETS 64
+#define OPNA_PROF_RATIO_STEP 16
+
+// lock free, record can be called from any thread including the audio callback
+struct opna_prof {
+  atomic_uint_fast64_t calls;
+  atomic_uint_fast64_t samples;
+  atomic_uint_fast64_t total_ns;
+  atomic_uint_fast64_t max_ns;
+  // calls that took longer than the period of the samples they produced
+  atomic_uint_fast64_t overruns;
+  atomic_uint_fast32_t time_hist[OPNA_PROF_TIME_BUCKETS];
+  atomic_uint_fast32_t ratio_hist[OPNA_PROF_RATIO_BUCKETS];
+};
+
+struct opna_prof_stats {
+  uint64_t calls;
+  uint64_t samples;
+  uint64_t total_ns;
+  uint64_t max_ns;
+  uint64_t overruns;
+  uint32_t time_hist[OPNA_PROF_TIME_BUCKETS];
+  uint32_t ratio_hist[OPNA_PROF_RATIO_BUCKETS];
+};
+
+void opna_prof_reset(struct opna_prof *prof);
+// monotonic clock in ns
+uint64_t opna_prof_now(void);
+// samples at rate Hz were produced in ns
+void opna_prof_record(struct opna_prof *prof, uint64_t ns, unsigned samples, unsigned rate);
+// snapshot, counters may be updated concurrently
+void opna_prof_get(struct opna_prof *prof, struct opna_prof_stats *stats);
+
+double opna_prof_ns_per_sample(const struct opna_prof_stats *stats);
+// upper bound of the bucket holding the p (0.0-1.0) quantile
+uint64_t opna_prof_time_quantile(const struct opna_prof_stats *stats, double p);
+double opna_prof_ratio_quantile(const struct opna_prof_stats *stats, double p);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBOPNA_OPNAPROF_H_INCLUDED */
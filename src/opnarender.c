@@ -0,0 +1,326 @@
+#include "opnarender.h"
+#include "opnaprof.h"
+
+#include <stdlib.h>
+#include <pthread.h>
+
+// samples rendered by every thread before the partial buffers are summed
+#define RENDER_SEGMENT 16384
+// 6 fm channels + rhythm
+#define RENDER_MAXTHREADS 7
+
+unsigned opna_regwrite_mask(unsigned reg, unsigned val) {
+  reg &= (1<<9)-1;
+  val &= (1<<8)-1;
+
+  if (reg < 0x20) {
+    return (reg >= 0x10) ? FM_OPNA_MASK_RHYTHM : 0;
+  }
+  switch (reg & 0xff) {
+  case 0x27:
+    return FM_OPNA_MASK_ALL;
+  case 0x28:
+    {
+      int c = val & 0x3;
+      if (c == 3) return 0;
+      if (val & 0x4) c += 3;
+      return 1u << c;
+    }
+  }
+  if ((reg & 0xff) < 0x30) return 0;
+
+  int c = reg & 0x3;
+  if (c == 3) return 0;
+  if (reg & (1<<8)) c += 3;
+  if ((reg & 0xf0) == 0xa0) {
+    switch (reg & 0xc) {
+    case 0x4:
+    case 0xc:
+      // blk/fnum latch is shared by all channels
+      return FM_OPNA_MASK_ALL;
+    case 0x8:
+      // channel 3 special mode frequencies
+      return 1u << 2;
+    }
+  }
+  return 1u << c;
+}
+
+void opna_render_log(struct fm_opna *opna,
+                     const struct opna_regwrite *log, size_t writes,
+                     int32_t *lbuf, int32_t *rbuf, unsigned samples) {
+  unsigned pos = 0;
+  for (size_t i = 0; i < writes; i++) {
+    if (log[i].sample >= samples) break;
+    if (log[i].sample > pos) {
+      fm_opna_fmout(opna, lbuf+pos, rbuf+pos, log[i].sample-pos);
+      pos = log[i].sample;
+    }
+    fm_opna_fmwritereg(opna, log[i].reg, log[i].val);
+  }
+  fm_opna_fmout(opna, lbuf+pos, rbuf+pos, samples-pos);
+}
+
+struct render_ctx;
+
+struct render_thread {
+  struct fm_opna opna;
+  struct render_ctx *ctx;
+  unsigned index;
+  unsigned mask;
+  size_t logpos;
+  int32_t *lbuf;
+  int32_t *rbuf;
+  pthread_t thread;
+};
+
+struct render_ctx {
+  const struct opna_regwrite *log;
+  size_t writes;
+  int32_t *lbuf;
+  int32_t *rbuf;
+  unsigned samples;
+  unsigned threads;
+  struct render_thread *thread[RENDER_MAXTHREADS];
+  pthread_barrier_t barrier;
+  pthread_mutex_t start_mutex;
+  pthread_cond_t start_cond;
+  bool started;
+  bool abort;
+};
+
+// first thread whose channels a write with mask affects, writes that
+// affect no channel go to thread 0 so that they are counted and shadowed
+static unsigned render_write_owner(const struct render_ctx *ctx, unsigned mask) {
+  for (unsigned k = 0; k < ctx->threads; k++) {
+    if (ctx->thread[k]->mask & mask) return k;
+  }
+  return 0;
+}
+
+static void render_thread_span(struct render_thread *t, unsigned start, unsigned len) {
+  const struct render_ctx *ctx = t->ctx;
+  for (unsigned i = 0; i < len; i++) {
+    t->lbuf[i] = 0;
+    t->rbuf[i] = 0;
+  }
+  unsigned pos = start;
+  unsigned end = start + len;
+  while (pos < end) {
+    while (t->logpos < ctx->writes && ctx->log[t->logpos].sample <= pos) {
+      const struct opna_regwrite *w = &ctx->log[t->logpos++];
+      unsigned mask = opna_regwrite_mask(w->reg, w->val);
+      if (render_write_owner(ctx, mask) == t->index) {
+        fm_opna_fmwritereg(&t->opna, w->reg, w->val);
+      } else if (mask & t->mask) {
+#ifdef LIBOPNA_ENABLE_STATS
+        // counted once, by the first thread that applies it
+        struct fm_opna_stats stats = t->opna.stats;
+        fm_opna_fmwritereg(&t->opna, w->reg, w->val);
+        t->opna.stats = stats;
+#else
+        fm_opna_fmwritereg(&t->opna, w->reg, w->val);
+#endif
+      }
+    }
+    unsigned next = end;
+    if (t->logpos < ctx->writes && ctx->log[t->logpos].sample < next) {
+      next = ctx->log[t->logpos].sample;
+    }
+    fm_opna_fmout_mask(&t->opna, t->lbuf+(pos-start), t->rbuf+(pos-start),
+                       next-pos, t->mask);
+    pos = next;
+  }
+}
+
+static void render_thread_reduce(struct render_thread *t, unsigned start, unsigned len) {
+  const struct render_ctx *ctx = t->ctx;
+  unsigned from = len * t->index / ctx->threads;
+  unsigned to = len * (t->index+1) / ctx->threads;
+  for (unsigned i = from; i < to; i++) {
+    int32_t l = 0, r = 0;
+    for (unsigned k = 0; k < ctx->threads; k++) {
+      l += ctx->thread[k]->lbuf[i];
+      r += ctx->thread[k]->rbuf[i];
+    }
+    ctx->lbuf[start+i] = l;
+    ctx->rbuf[start+i] = r;
+  }
+}
+
+static void *render_thread_main(void *arg) {
+  struct render_thread *t = arg;
+  struct render_ctx *ctx = t->ctx;
+
+  pthread_mutex_lock(&ctx->start_mutex);
+  while (!ctx->started && !ctx->abort) {
+    pthread_cond_wait(&ctx->start_cond, &ctx->start_mutex);
+  }
+  bool abort = ctx->abort;
+  pthread_mutex_unlock(&ctx->start_mutex);
+  if (abort) return 0;
+
+  for (unsigned seg = 0; seg < ctx->samples; seg += RENDER_SEGMENT) {
+    unsigned len = ctx->samples - seg;
+    if (len > RENDER_SEGMENT) len = RENDER_SEGMENT;
+    render_thread_span(t, seg, len);
+    pthread_barrier_wait(&ctx->barrier);
+    render_thread_reduce(t, seg, len);
+    pthread_barrier_wait(&ctx->barrier);
+  }
+  return 0;
+}
+
+#ifdef LIBOPNA_ENABLE_STATS
+// every write is counted by exactly one thread, so the counters add up.
+// before is the state all threads started from.
+static void render_merge_stats(struct fm_opna *opna, const struct fm_opna_stats *before,
+                               const struct render_ctx *ctx) {
+  struct fm_opna_stats *st = &opna->stats;
+  // samples and thread 0's share are in already
+  for (unsigned k = 1; k < ctx->threads; k++) {
+    const struct fm_opna_stats *ts = &ctx->thread[k]->opna.stats;
+    for (int c = 0; c < 6; c++) {
+      if (ctx->thread[k]->mask & (1u<<c)) st->active[c] = ts->active[c];
+    }
+    st->env_transitions += ts->env_transitions - before->env_transitions;
+    st->keyons += ts->keyons - before->keyons;
+    for (int i = 0; i < FM_OPNA_WRITE_CLASSES; i++) {
+      st->writes[i] += ts->writes[i] - before->writes[i];
+    }
+    st->redundant += ts->redundant - before->redundant;
+  }
+  // each register from the thread that last wrote it. key on is the one
+  // address written by several threads, take its last write from the log
+  for (unsigned reg = 0; reg < 0x200; reg++) {
+    if ((reg & 0xff) == 0x28) continue;
+    unsigned k = render_write_owner(ctx, opna_regwrite_mask(reg, 0));
+    opna->regs[reg] = ctx->thread[k]->opna.regs[reg];
+  }
+  for (size_t i = 0; i < ctx->writes; i++) {
+    unsigned reg = ctx->log[i].reg & 0x1ff;
+    if ((reg & 0xff) == 0x28) opna->regs[reg] = ctx->log[i].val & 0xff;
+  }
+}
+#endif
+
+static void render_merge_state(struct fm_opna *opna, const struct render_ctx *ctx) {
+#ifdef LIBOPNA_ENABLE_STATS
+  const struct fm_opna_stats before = opna->stats;
+#endif
+  // channel independent state is identical in every thread, the
+  // profiler was taken out of the copies
+  struct opna_prof *prof = opna->prof;
+  *opna = ctx->thread[0]->opna;
+  opna->prof = prof;
+  for (unsigned k = 1; k < ctx->threads; k++) {
+    const struct render_thread *t = ctx->thread[k];
+    for (int c = 0; c < 6; c++) {
+      if (!(t->mask & (1u<<c))) continue;
+      opna->channel[c] = t->opna.channel[c];
+      opna->lselect[c] = t->opna.lselect[c];
+      opna->rselect[c] = t->opna.rselect[c];
+    }
+    // channel 3 special mode frequencies only go to the owner of channel 3
+    if (t->mask & (1u<<2)) {
+      opna->ch3 = t->opna.ch3;
+    }
+    if (t->mask & FM_OPNA_MASK_RHYTHM) {
+      opna->rhythm = t->opna.rhythm;
+    }
+  }
+#ifdef LIBOPNA_ENABLE_STATS
+  render_merge_stats(opna, &before, ctx);
+#endif
+}
+
+bool opna_render_log_parallel(struct fm_opna *opna,
+                              const struct opna_regwrite *log, size_t writes,
+                              int32_t *lbuf, int32_t *rbuf, unsigned samples,
+                              unsigned threads) {
+  if (threads > RENDER_MAXTHREADS) threads = RENDER_MAXTHREADS;
+  if (threads < 2) {
+    opna_render_log(opna, log, writes, lbuf, rbuf, samples);
+    return true;
+  }
+  // writes after the end are not applied, same as opna_render_log
+  size_t n = 0;
+  while (n < writes && log[n].sample < samples) n++;
+
+  uint64_t start = opna->prof ? opna_prof_now() : 0;
+  struct render_ctx ctx = {0};
+  ctx.log = log;
+  ctx.writes = n;
+  ctx.lbuf = lbuf;
+  ctx.rbuf = rbuf;
+  ctx.samples = samples;
+  ctx.threads = threads;
+
+  for (unsigned k = 0; k < threads; k++) {
+    struct render_thread *t = malloc(sizeof(*t));
+    int32_t *buf = malloc(sizeof(int32_t) * RENDER_SEGMENT * 2);
+    if (!t || !buf) {
+      free(t);
+      free(buf);
+      for (unsigned i = 0; i < k; i++) {
+        free(ctx.thread[i]->lbuf);
+        free(ctx.thread[i]);
+      }
+      return false;
+    }
+    t->opna = *opna;
+    // each copy would count its partial segments as calls of their own,
+    // the whole call is recorded once below instead
+    t->opna.prof = 0;
+    t->ctx = &ctx;
+    t->index = k;
+    t->mask = 0;
+    t->logpos = 0;
+    t->lbuf = buf;
+    t->rbuf = buf + RENDER_SEGMENT;
+    ctx.thread[k] = t;
+  }
+  // round robin, rhythm goes to the thread with the fewest fm channels
+  for (int c = 0; c < 6; c++) {
+    ctx.thread[c % threads]->mask |= 1u << c;
+  }
+  ctx.thread[threads-1]->mask |= FM_OPNA_MASK_RHYTHM;
+
+  bool ret = false;
+  pthread_barrier_init(&ctx.barrier, 0, threads);
+  pthread_mutex_init(&ctx.start_mutex, 0);
+  pthread_cond_init(&ctx.start_cond, 0);
+  unsigned created = 1;
+  for (; created < threads; created++) {
+    struct render_thread *t = ctx.thread[created];
+    if (pthread_create(&t->thread, 0, render_thread_main, t)) break;
+  }
+  pthread_mutex_lock(&ctx.start_mutex);
+  if (created == threads) ctx.started = true;
+  else ctx.abort = true;
+  pthread_cond_broadcast(&ctx.start_cond);
+  pthread_mutex_unlock(&ctx.start_mutex);
+
+  if (ctx.started) {
+    render_thread_main(ctx.thread[0]);
+  }
+  for (unsigned k = 1; k < created; k++) {
+    pthread_join(ctx.thread[k]->thread, 0);
+  }
+  if (ctx.started) {
+    render_merge_state(opna, &ctx);
+    if (opna->prof) {
+      opna_prof_record(opna->prof, opna_prof_now() - start, samples, FM_OPNA_SAMPLERATE);
+    }
+    ret = true;
+  }
+
+  pthread_cond_destroy(&ctx.start_cond);
+  pthread_mutex_destroy(&ctx.start_mutex);
+  pthread_barrier_destroy(&ctx.barrier);
+  for (unsigned k = 0; k < threads; k++) {
+    free(ctx.thread[k]->lbuf);
+    free(ctx.thread[k]);
+  }
+  return ret;
+}
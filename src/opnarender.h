@@ -0,0 +1,39 @@
+#ifndef LIBOPNA_OPNARENDER_H_INCLUDED
+#define LIBOPNA_OPNARENDER_H_INCLUDED
+
+#include <stddef.h>
+#include "opnafm.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// one register write of a timestamped log
+struct opna_regwrite {
+  // in samples from the start of the log, must be nondecreasing
+  uint32_t sample;
+  uint16_t reg;
+  uint8_t val;
+};
+
+// returns the FM_OPNA_MASK_* bits of the channels a write affects
+unsigned opna_regwrite_mask(unsigned reg, unsigned val);
+
+// render samples while applying the log, writes after samples are not applied
+void opna_render_log(struct fm_opna *opna,
+                     const struct opna_regwrite *log, size_t writes,
+                     int32_t *lbuf, int32_t *rbuf, unsigned samples);
+
+// same output and final state as opna_render_log, the channels are
+// split into disjoint sets rendered on separate threads.
+// returns false when the threads could not be started.
+bool opna_render_log_parallel(struct fm_opna *opna,
+                              const struct opna_regwrite *log, size_t writes,
+                              int32_t *lbuf, int32_t *rbuf, unsigned samples,
+                              unsigned threads);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBOPNA_OPNARENDER_H_INCLUDED */
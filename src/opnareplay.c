@@ -0,0 +1,131 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "opnatrace.h"
+#include "fmvoice.h"
+#include "opnaprof.h"
+#include "wavfile.h"
+
+#define BLOCK 4096
+
+// one pass over the trace, out may be NULL
+static bool replay(struct opna_trace *trace, struct fm_voicepool *pool,
+                   struct wavfile *out, uint64_t *samples) {
+  static int32_t buf[BLOCK];
+  static int16_t obuf[BLOCK];
+  uint64_t pos = 0;
+  opna_trace_rewind(trace);
+  for (;;) {
+    struct opna_trace_event ev;
+    if (!opna_trace_next(trace, &ev)) return false;
+    while (pos < ev.sample) {
+      unsigned len = BLOCK;
+      if (len > ev.sample - pos) len = ev.sample - pos;
+      memset(buf, 0, sizeof(int32_t) * len);
+      fm_voicepool_render(pool, buf, len);
+      if (out) {
+        wavfile_convert(obuf, buf, len);
+        if (!wavfile_write(out, obuf, len)) return false;
+      }
+      pos += len;
+    }
+    switch (ev.type) {
+    case OPNA_TRACE_END:
+      *samples = pos;
+      return true;
+    case OPNA_TRACE_KEYON:
+      fm_voicepool_keyon(pool, ev.key % FM_VOICE_KEYS, ev.blk & 7, ev.fnum & 0x7ff);
+      break;
+    case OPNA_TRACE_KEYOFF:
+      fm_voicepool_keyoff(pool, ev.key % FM_VOICE_KEYS);
+      break;
+    case OPNA_TRACE_PATCH:
+      fm_voicepool_set_patch(pool, &ev.patch);
+      break;
+    }
+  }
+}
+
+static void usage(const char *name) {
+  printf("usage: %s [-r repeat] [-v voices] [-o out.wav] trace\n", name);
+  printf("  -r repeat  render the trace this many times (default 1)\n");
+  printf("  -v voices  polyphony instead of the one recorded, 1-%d\n", FM_VOICE_MAX);
+  printf("  -o out     also write the first pass, with each event on the sample the editor\n");
+  printf("             rendered it at\n");
+}
+
+int main(int argc, char **argv) {
+  int repeat = 1;
+  int voices = 0;
+  const char *outpath = 0;
+  int argi = 1;
+  while (argi+1 < argc && argv[argi][0] == '-') {
+    if (!strcmp(argv[argi], "-r")) {
+      repeat = atoi(argv[argi+1]);
+    } else if (!strcmp(argv[argi], "-v")) {
+      voices = atoi(argv[argi+1]);
+      if (voices < 1 || voices > FM_VOICE_MAX) {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (!strcmp(argv[argi], "-o")) {
+      outpath = argv[argi+1];
+    } else {
+      break;
+    }
+    argi += 2;
+  }
+  if (argc - argi != 1 || repeat < 1) {
+    usage(argv[0]);
+    return 1;
+  }
+  const char *inpath = argv[argi];
+
+  int ret = 1;
+  struct opna_trace trace;
+  if (!opna_trace_load(&trace, inpath)) {
+    fprintf(stderr, "cannot read %s\n", inpath);
+    return 1;
+  }
+  unsigned count = voices ? (unsigned)voices : trace.voices;
+  if (!count || count > FM_VOICE_MAX) {
+    fprintf(stderr, "%s: bad voice count %u\n", inpath, count);
+    goto err_trace;
+  }
+  struct wavfile wav;
+  if (outpath && !wavfile_open(&wav, outpath, FM_OPNA_SAMPLERATE, 1)) {
+    fprintf(stderr, "cannot write %s\n", outpath);
+    goto err_trace;
+  }
+  uint64_t samples = 0;
+  double sec = 0;
+  bool ok = true;
+  for (int r = 0; ok && r < repeat; r++) {
+    // a fresh pool per pass, as in a new editor session
+    struct fm_voicepool pool;
+    if (!fm_voicepool_init(&pool, count)) {
+      fprintf(stderr, "failed to allocate %u voices\n", count);
+      ok = false;
+      break;
+    }
+    uint64_t start = opna_prof_now();
+    if (!replay(&trace, &pool, (outpath && !r) ? &wav : 0, &samples)) {
+      fprintf(stderr, "%s: truncated or corrupt trace\n", inpath);
+      ok = false;
+    }
+    sec += (double)(opna_prof_now() - start) / 1e9;
+    fm_voicepool_free(&pool);
+  }
+  if (outpath && !wavfile_close(&wav) && ok) {
+    fprintf(stderr, "error writing %s\n", outpath);
+    ok = false;
+  }
+  if (!ok) goto err_trace;
+  double len = (double)samples / FM_OPNA_SAMPLERATE;
+  printf("%s: %.1fs x %d with %u voices in %.2fs (%.1fx real time)\n",
+         inpath, len, repeat, count, sec, sec > 0 ? len * repeat / sec : 0.0);
+  ret = 0;
+err_trace:
+  opna_trace_free(&trace);
+  return ret;
+}
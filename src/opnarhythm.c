@@ -0,0 +1,163 @@
+#include "opnarhythm.h"
+
+#include <stddef.h>
+
+// start/end of each instrument in the internal ROM, in bytes
+static const uint16_t rhythm_romaddr[OPNA_RHYTHM_NUM][2] = {
+  {0x0000, 0x01c0}, // bd
+  {0x01c0, 0x0440}, // sd
+  {0x0440, 0x1b80}, // top
+  {0x1b80, 0x1d00}, // hh
+  {0x1d00, 0x1f80}, // tom
+  {0x1f80, 0x2000}, // rim
+};
+
+static const uint16_t adpcma_steptable[49] = {
+    16,   17,   19,   21,   23,   25,   28,   31,
+    34,   37,   41,   45,   50,   55,   60,   66,
+    73,   80,   88,   97,  107,  118,  130,  143,
+   157,  173,  190,  209,  230,  253,  279,  307,
+   337,  371,  408,  449,  494,  544,  598,  658,
+   724,  796,  876,  963, 1060, 1166, 1282, 1411,
+  1552,
+};
+
+static const int8_t adpcma_indexadj[8] = {
+  -1, -1, -1, -1, 2, 5, 7, 9,
+};
+
+// round(4096*10^(-0.75*i/20)), 0.75dB per step
+static const uint16_t rhythm_voltable[96] = {
+  4096, 3757, 3446, 3161, 2900, 2660, 2440, 2238,
+  2053, 1883, 1727, 1584, 1453, 1333, 1223, 1122,
+  1029,  944,  866,  794,  728,  668,  613,  562,
+   516,  473,  434,  398,  365,  335,  307,  282,
+   258,  237,  217,  199,  183,  168,  154,  141,
+   130,  119,  109,  100,   92,   84,   77,   71,
+    65,   60,   55,   50,   46,   42,   39,   35,
+    33,   30,   27,   25,   23,   21,   19,   18,
+    16,   15,   14,   13,   12,   11,   10,    9,
+     8,    7,    7,    6,    6,    5,    5,    4,
+     4,    4,    3,    3,    3,    3,    2,    2,
+     2,    2,    2,    2,    1,    1,    1,    1,
+};
+
+static void opna_rhythm_voice_reset(struct opna_rhythm_voice *voice) {
+  voice->addr = 0;
+  voice->end = 0;
+  voice->acc = 0;
+  voice->step_index = 0;
+  voice->il = 0;
+  voice->out = 0;
+  voice->playing = false;
+  voice->lselect = false;
+  voice->rselect = false;
+}
+
+void opna_rhythm_reset(struct opna_rhythm *rhythm) {
+  rhythm->rom = 0;
+  for (int i = 0; i < OPNA_RHYTHM_NUM; i++) {
+    opna_rhythm_voice_reset(&rhythm->voice[i]);
+  }
+  rhythm->tl = 0;
+  rhythm->div3 = 0;
+}
+
+void opna_rhythm_set_rom(struct opna_rhythm *rhythm, const uint8_t *rom) {
+  rhythm->rom = rom;
+}
+
+static void opna_rhythm_key(struct opna_rhythm *rhythm, int v, bool keyon) {
+  struct opna_rhythm_voice *voice = &rhythm->voice[v];
+  if (keyon) {
+    if (!rhythm->rom) return;
+    voice->addr = rhythm_romaddr[v][0] << 1;
+    voice->end = rhythm_romaddr[v][1] << 1;
+    voice->acc = 0;
+    voice->step_index = 0;
+    voice->out = 0;
+    voice->playing = true;
+  } else {
+    voice->playing = false;
+    voice->out = 0;
+  }
+}
+
+void opna_rhythm_writereg(struct opna_rhythm *rhythm, unsigned reg, unsigned val) {
+  reg &= 0xff;
+  val &= 0xff;
+  switch (reg) {
+  case 0x10:
+    for (int i = 0; i < OPNA_RHYTHM_NUM; i++) {
+      if (val & (1<<i)) opna_rhythm_key(rhythm, i, !(val & 0x80));
+    }
+    break;
+  case 0x11:
+    rhythm->tl = val & 0x3f;
+    break;
+  case 0x18:
+  case 0x19:
+  case 0x1a:
+  case 0x1b:
+  case 0x1c:
+  case 0x1d:
+    {
+      struct opna_rhythm_voice *voice = &rhythm->voice[reg - 0x18];
+      voice->lselect = val & 0x80;
+      voice->rselect = val & 0x40;
+      voice->il = val & 0x1f;
+    }
+    break;
+  }
+}
+
+// returns false when the voice reached its end address
+static bool opna_rhythm_decode(struct opna_rhythm_voice *voice,
+                               const uint8_t *rom, unsigned vol) {
+  if (voice->addr == voice->end) {
+    voice->playing = false;
+    voice->out = 0;
+    return false;
+  }
+  unsigned nibble = rom[voice->addr >> 1];
+  if (!(voice->addr & 1)) nibble >>= 4;
+  nibble &= 0xf;
+  voice->addr++;
+
+  int step = adpcma_steptable[voice->step_index];
+  int delta = ((2*(nibble & 0x7) + 1) * step) >> 3;
+  if (nibble & 0x8) delta = -delta;
+  // 12bit wraparound, sign extended
+  int acc = (voice->acc + delta) & 0xfff;
+  if (acc & 0x800) acc -= 0x1000;
+  voice->acc = acc;
+
+  int index = voice->step_index + adpcma_indexadj[nibble & 0x7];
+  if (index < 0) index = 0;
+  if (index > 48) index = 48;
+  voice->step_index = index;
+
+  voice->out = ((acc << 2) * (int)vol) >> 12;
+  return true;
+}
+
+void opna_rhythm_mix(struct opna_rhythm *rhythm,
+                     int32_t *lbuf, int32_t *rbuf,
+                     unsigned samples, unsigned stride) {
+  for (int v = 0; v < OPNA_RHYTHM_NUM; v++) {
+    struct opna_rhythm_voice *voice = &rhythm->voice[v];
+    if (!voice->playing) continue;
+    unsigned vol = rhythm_voltable[(63 - rhythm->tl) + (31 - voice->il)];
+    unsigned div3 = rhythm->div3;
+    for (unsigned i = 0; i < samples; i++) {
+      if (!div3) {
+        if (!opna_rhythm_decode(voice, rhythm->rom, vol)) break;
+        div3 = 3;
+      }
+      div3--;
+      if (voice->lselect) lbuf[i*stride] += voice->out;
+      if (voice->rselect) rbuf[i*stride] += voice->out;
+    }
+  }
+  rhythm->div3 = (rhythm->div3 + 3 - (samples % 3)) % 3;
+}
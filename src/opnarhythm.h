@@ -0,0 +1,64 @@
+#ifndef LIBOPNA_OPNARHYTHM_H_INCLUDED
+#define LIBOPNA_OPNARHYTHM_H_INCLUDED
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// size of the YM2608 internal rhythm ROM (4bit ADPCM-A)
+#define OPNA_RHYTHM_ROM_SIZE 0x2000
+
+enum {
+  OPNA_RHYTHM_BD,
+  OPNA_RHYTHM_SD,
+  OPNA_RHYTHM_TOP,
+  OPNA_RHYTHM_HH,
+  OPNA_RHYTHM_TOM,
+  OPNA_RHYTHM_RIM,
+  OPNA_RHYTHM_NUM
+};
+
+struct opna_rhythm_voice {
+  // current and end address in nibbles
+  uint16_t addr;
+  uint16_t end;
+  // 12bit ADPCM-A accumulator
+  int16_t acc;
+  uint8_t step_index;
+  // instrument level
+  uint8_t il;
+  // last decoded sample with volume applied
+  int16_t out;
+  bool playing;
+  bool lselect;
+  bool rselect;
+};
+
+struct opna_rhythm {
+  // not owned; shared read-only between all chips
+  const uint8_t *rom;
+  struct opna_rhythm_voice voice[OPNA_RHYTHM_NUM];
+  // rhythm total level
+  uint8_t tl;
+  // ADPCM-A runs at 1/3 of the FM sample rate
+  uint8_t div3;
+};
+
+void opna_rhythm_reset(struct opna_rhythm *rhythm);
+// rom must be OPNA_RHYTHM_ROM_SIZE bytes and stay valid while the chip is used.
+// It is never written, so one (possibly mmap()ed) copy can serve any number of chips.
+void opna_rhythm_set_rom(struct opna_rhythm *rhythm, const uint8_t *rom);
+void opna_rhythm_writereg(struct opna_rhythm *rhythm, unsigned reg, unsigned val);
+// adds to lbuf[i*stride], rbuf[i*stride]
+void opna_rhythm_mix(struct opna_rhythm *rhythm,
+                     int32_t *lbuf, int32_t *rbuf,
+                     unsigned samples, unsigned stride);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBOPNA_OPNARHYTHM_H_INCLUDED */
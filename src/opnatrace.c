@@ -0,0 +1,168 @@
+#include "opnatrace.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define TRACE_MAGIC "OPNATRC1"
+#define TRACE_HEADER 12
+#define TRACE_PATCH 38
+
+static void put(struct opna_trace_writer *w, const uint8_t *buf, size_t len) {
+  if (w->ok && fwrite(buf, 1, len, w->f) != len) w->ok = false;
+}
+
+static void put_event(struct opna_trace_writer *w, uint32_t sample, unsigned type,
+                      const uint8_t *body, size_t len) {
+  uint8_t buf[5+1+TRACE_PATCH];
+  size_t n = 0;
+  uint32_t delta = sample - w->last;
+  w->last = sample;
+  while (delta >= 0x80) {
+    buf[n++] = 0x80 | (delta & 0x7f);
+    delta >>= 7;
+  }
+  buf[n++] = delta;
+  buf[n++] = type;
+  memcpy(buf+n, body, len);
+  put(w, buf, n+len);
+}
+
+bool opna_trace_open(struct opna_trace_writer *w, const char *path, unsigned voices) {
+  w->f = fopen(path, "wb");
+  if (!w->f) return false;
+  w->last = 0;
+  w->ok = true;
+  uint8_t header[TRACE_HEADER];
+  memcpy(header, TRACE_MAGIC, 8);
+  for (int i = 0; i < 4; i++) header[8+i] = voices >> (8*i);
+  put(w, header, sizeof(header));
+  return true;
+}
+
+void opna_trace_keyon(struct opna_trace_writer *w, uint32_t sample,
+                      unsigned key, unsigned blk, unsigned fnum) {
+  uint8_t body[5] = {key, key >> 8, blk, fnum, fnum >> 8};
+  put_event(w, sample, OPNA_TRACE_KEYON, body, sizeof(body));
+}
+
+void opna_trace_keyoff(struct opna_trace_writer *w, uint32_t sample, unsigned key) {
+  uint8_t body[2] = {key, key >> 8};
+  put_event(w, sample, OPNA_TRACE_KEYOFF, body, sizeof(body));
+}
+
+void opna_trace_patch(struct opna_trace_writer *w, uint32_t sample, const struct fm_patch *patch) {
+  uint8_t body[TRACE_PATCH];
+  uint8_t *p = body;
+  *p++ = patch->alg;
+  *p++ = patch->fb;
+  for (int s = 0; s < 4; s++) {
+    const struct fm_patch_slot *slot = &patch->slot[s];
+    *p++ = slot->ar;
+    *p++ = slot->dr;
+    *p++ = slot->sr;
+    *p++ = slot->rr;
+    *p++ = slot->sl;
+    *p++ = slot->tl;
+    *p++ = slot->ks;
+    *p++ = slot->mul;
+    *p++ = slot->det;
+  }
+  put_event(w, sample, OPNA_TRACE_PATCH, body, sizeof(body));
+}
+
+bool opna_trace_close(struct opna_trace_writer *w, uint32_t sample) {
+  put_event(w, sample, OPNA_TRACE_END, 0, 0);
+  if (fclose(w->f)) w->ok = false;
+  w->f = 0;
+  return w->ok;
+}
+
+bool opna_trace_load(struct opna_trace *trace, const char *path) {
+  memset(trace, 0, sizeof(*trace));
+  FILE *f = fopen(path, "rb");
+  if (!f) return false;
+  if (fseek(f, 0, SEEK_END)) goto err;
+  long len = ftell(f);
+  if (len < TRACE_HEADER || fseek(f, 0, SEEK_SET)) goto err;
+  trace->data = malloc(len);
+  if (!trace->data) goto err;
+  if (fread(trace->data, 1, len, f) != (size_t)len) goto err_data;
+  if (memcmp(trace->data, TRACE_MAGIC, 8)) goto err_data;
+  trace->size = len;
+  for (int i = 0; i < 4; i++) trace->voices |= (unsigned)trace->data[8+i] << (8*i);
+  fclose(f);
+  opna_trace_rewind(trace);
+  return true;
+err_data:
+  free(trace->data);
+  trace->data = 0;
+err:
+  fclose(f);
+  return false;
+}
+
+void opna_trace_free(struct opna_trace *trace) {
+  free(trace->data);
+  trace->data = 0;
+  trace->size = 0;
+}
+
+void opna_trace_rewind(struct opna_trace *trace) {
+  trace->pos = TRACE_HEADER;
+  trace->sample = 0;
+}
+
+bool opna_trace_next(struct opna_trace *trace, struct opna_trace_event *ev) {
+  const uint8_t *d = trace->data;
+  size_t pos = trace->pos;
+  uint32_t delta = 0;
+  for (int shift = 0;; shift += 7) {
+    if (pos >= trace->size || shift > 28) return false;
+    uint8_t b = d[pos++];
+    delta |= (uint32_t)(b & 0x7f) << shift;
+    if (!(b & 0x80)) break;
+  }
+  if (pos >= trace->size) return false;
+  ev->type = d[pos++];
+  size_t len;
+  switch (ev->type) {
+  case OPNA_TRACE_END: len = 0; break;
+  case OPNA_TRACE_KEYON: len = 5; break;
+  case OPNA_TRACE_KEYOFF: len = 2; break;
+  case OPNA_TRACE_PATCH: len = TRACE_PATCH; break;
+  default: return false;
+  }
+  if (trace->size - pos < len) return false;
+  const uint8_t *p = d + pos;
+  switch (ev->type) {
+  case OPNA_TRACE_KEYON:
+    ev->key = p[0] | (p[1] << 8);
+    ev->blk = p[2];
+    ev->fnum = p[3] | (p[4] << 8);
+    break;
+  case OPNA_TRACE_KEYOFF:
+    ev->key = p[0] | (p[1] << 8);
+    break;
+  case OPNA_TRACE_PATCH:
+    ev->patch.alg = *p++;
+    ev->patch.fb = *p++;
+    for (int s = 0; s < 4; s++) {
+      struct fm_patch_slot *slot = &ev->patch.slot[s];
+      slot->ar = *p++;
+      slot->dr = *p++;
+      slot->sr = *p++;
+      slot->rr = *p++;
+      slot->sl = *p++;
+      slot->tl = *p++;
+      slot->ks = *p++;
+      slot->mul = *p++;
+      slot->det = *p++;
+    }
+    break;
+  }
+  trace->sample += delta;
+  ev->sample = trace->sample;
+  // nothing follows the end
+  trace->pos = ev->type == OPNA_TRACE_END ? trace->size : pos + len;
+  return true;
+}
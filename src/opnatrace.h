@@ -0,0 +1,70 @@
+#ifndef LIBOPNA_OPNATRACE_H_INCLUDED
+#define LIBOPNA_OPNATRACE_H_INCLUDED
+
+#include <stdio.h>
+#include <stddef.h>
+#include "opnafm.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// "OPNATRC1", u32 voices, then events as varint sample delta, type byte
+// and the fields below little endian. OPNA_TRACE_END closes the trace.
+enum {
+  OPNA_TRACE_END,
+  // u16 key, u8 blk, u16 fnum
+  OPNA_TRACE_KEYON,
+  // u16 key
+  OPNA_TRACE_KEYOFF,
+  // struct fm_patch as 38 bytes: alg, fb, then per slot ar dr sr rr sl tl ks mul det
+  OPNA_TRACE_PATCH,
+};
+
+struct opna_trace_event {
+  // absolute, in samples
+  uint64_t sample;
+  uint8_t type;
+  uint16_t key;
+  uint8_t blk;
+  uint16_t fnum;
+  struct fm_patch patch;
+};
+
+// sample positions are only ever compared as 32 bit deltas, so a free
+// running unsigned counter works as the clock
+struct opna_trace_writer {
+  FILE *f;
+  uint32_t last;
+  bool ok;
+};
+
+bool opna_trace_open(struct opna_trace_writer *w, const char *path, unsigned voices);
+void opna_trace_keyon(struct opna_trace_writer *w, uint32_t sample,
+                      unsigned key, unsigned blk, unsigned fnum);
+void opna_trace_keyoff(struct opna_trace_writer *w, uint32_t sample, unsigned key);
+void opna_trace_patch(struct opna_trace_writer *w, uint32_t sample, const struct fm_patch *patch);
+// writes OPNA_TRACE_END at sample, false if any write failed
+bool opna_trace_close(struct opna_trace_writer *w, uint32_t sample);
+
+struct opna_trace {
+  uint8_t *data;
+  size_t size;
+  unsigned voices;
+  // read position and clock of opna_trace_next
+  size_t pos;
+  uint64_t sample;
+};
+
+bool opna_trace_load(struct opna_trace *trace, const char *path);
+void opna_trace_free(struct opna_trace *trace);
+void opna_trace_rewind(struct opna_trace *trace);
+// false on a truncated or corrupt trace, OPNA_TRACE_END is returned once
+// and after that every call fails
+bool opna_trace_next(struct opna_trace *trace, struct opna_trace_event *ev);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBOPNA_OPNATRACE_H_INCLUDED */
@@ -0,0 +1,152 @@
+#define _GNU_SOURCE
+#include "rtsafe.h"
+
+#include <string.h>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#endif
+
+#define RT_PAGE 4096
+#define RT_STACK_PREFAULT (64*1024)
+
+bool rt_lock_memory(void) {
+#ifdef __linux__
+  return !mlockall(MCL_CURRENT|MCL_FUTURE);
+#else
+  return false;
+#endif
+}
+
+void rt_prefault(void *ptr, size_t len) {
+  volatile char *p = ptr;
+  for (size_t i = 0; i < len; i += RT_PAGE) {
+    p[i] = p[i];
+  }
+  if (len) p[len-1] = p[len-1];
+}
+
+static __attribute__((noinline)) void rt_prefault_stack(void) {
+  volatile char buf[RT_STACK_PREFAULT];
+  for (size_t i = 0; i < sizeof(buf); i += RT_PAGE) {
+    buf[i] = 0;
+  }
+}
+
+bool rt_thread_setup(void) {
+  rt_prefault_stack();
+#ifdef __linux__
+  int min = sched_get_priority_min(SCHED_FIFO);
+  int max = sched_get_priority_max(SCHED_FIFO);
+  struct sched_param sp = {0};
+  sp.sched_priority = min + (max - min) / 2;
+  return !pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp);
+#else
+  return false;
+#endif
+}
+
+bool rt_thread_pin(int cpu) {
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return !pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+  (void)cpu;
+  return false;
+#endif
+}
+
+#if defined(OPNATEST_RTCHECK) && defined(__GLIBC__)
+#include <stdatomic.h>
+#include <dlfcn.h>
+
+static __thread bool rt_critical;
+static __thread long rt_minflt;
+static __thread long rt_nvcsw;
+static atomic_ulong rt_allocs;
+static atomic_ulong rt_locks;
+static atomic_ulong rt_faults;
+static atomic_ulong rt_blocks;
+
+// interpose the allocator and mutexes of the whole process
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static int (*rt_real_mutex_lock)(pthread_mutex_t *mutex);
+
+// resolved before main, dlsym itself may allocate
+__attribute__((constructor)) static void rt_check_init(void) {
+  rt_real_mutex_lock = (int (*)(pthread_mutex_t *))dlsym(RTLD_NEXT, "pthread_mutex_lock");
+}
+
+void *malloc(size_t size) {
+  if (rt_critical) atomic_fetch_add(&rt_allocs, 1);
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+  if (rt_critical) atomic_fetch_add(&rt_allocs, 1);
+  return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  if (rt_critical) atomic_fetch_add(&rt_allocs, 1);
+  return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+  if (rt_critical) atomic_fetch_add(&rt_allocs, 1);
+  __libc_free(ptr);
+}
+
+int pthread_mutex_lock(pthread_mutex_t *mutex) {
+  if (rt_critical) atomic_fetch_add(&rt_locks, 1);
+  return rt_real_mutex_lock(mutex);
+}
+
+void rt_check_enter(void) {
+  struct rusage ru;
+  getrusage(RUSAGE_THREAD, &ru);
+  rt_minflt = ru.ru_minflt + ru.ru_majflt;
+  rt_nvcsw = ru.ru_nvcsw;
+  rt_critical = true;
+}
+
+void rt_check_leave(void) {
+  rt_critical = false;
+  struct rusage ru;
+  getrusage(RUSAGE_THREAD, &ru);
+  // page faults, and voluntary context switches which mean a blocking syscall
+  if (ru.ru_minflt + ru.ru_majflt != rt_minflt) atomic_fetch_add(&rt_faults, 1);
+  if (ru.ru_nvcsw != rt_nvcsw) atomic_fetch_add(&rt_blocks, 1);
+}
+
+bool rt_check_get(struct rt_check_stats *stats) {
+  stats->allocs = atomic_load(&rt_allocs);
+  stats->locks = atomic_load(&rt_locks);
+  stats->faults = atomic_load(&rt_faults);
+  stats->blocks = atomic_load(&rt_blocks);
+  return stats->allocs || stats->locks || stats->faults || stats->blocks;
+}
+
+#else
+
+void rt_check_enter(void) {
+}
+
+void rt_check_leave(void) {
+}
+
+bool rt_check_get(struct rt_check_stats *stats) {
+  memset(stats, 0, sizeof(*stats));
+  return false;
+}
+
+#endif
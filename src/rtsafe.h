@@ -0,0 +1,32 @@
+#ifndef OPNATEST_RTSAFE_H_INCLUDED
+#define OPNATEST_RTSAFE_H_INCLUDED
+
+#include <stddef.h>
+#include <stdbool.h>
+
+// lock current and future pages of the process into memory
+bool rt_lock_memory(void);
+// touch every page so that the first real access does not fault
+void rt_prefault(void *ptr, size_t len);
+// called from the thread itself: prefault its stack and request SCHED_FIFO.
+// returns false if that was denied, the caller can fall back to a
+// normal priority boost
+bool rt_thread_setup(void);
+// called from the thread itself
+bool rt_thread_pin(int cpu);
+
+// built with -DOPNATEST_RTCHECK, counts allocations, mutex locks, page
+// faults and blocking syscalls while the calling thread is between
+// rt_check_enter and rt_check_leave. without it these do nothing.
+struct rt_check_stats {
+  unsigned long allocs;
+  unsigned long locks;
+  unsigned long faults;
+  unsigned long blocks;
+};
+void rt_check_enter(void);
+void rt_check_leave(void);
+// true when any violation was counted
+bool rt_check_get(struct rt_check_stats *stats);
+
+#endif /* OPNATEST_RTSAFE_H_INCLUDED */
@@ -0,0 +1,169 @@
+#include "wavfile.h"
+
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+static void put_le16(uint8_t *p, uint16_t v) {
+  p[0] = v;
+  p[1] = v >> 8;
+}
+
+static void put_le32(uint8_t *p, uint32_t v) {
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+void wavfile_header(uint8_t *h, unsigned rate, unsigned channels, uint32_t frames) {
+  uint32_t datasize = frames * channels * 2;
+  memcpy(h, "RIFF", 4);
+  put_le32(h+4, 36 + datasize);
+  memcpy(h+8, "WAVEfmt ", 8);
+  put_le32(h+16, 16);
+  put_le16(h+20, 1);
+  put_le16(h+22, channels);
+  put_le32(h+24, rate);
+  put_le32(h+28, rate * channels * 2);
+  put_le16(h+32, channels * 2);
+  put_le16(h+34, 16);
+  memcpy(h+36, "data", 4);
+  put_le32(h+40, datasize);
+}
+
+static uint8_t *wavfile_alloc(void) {
+  void *p;
+#ifdef _WIN32
+  p = _aligned_malloc(WAVFILE_BUFSIZE, 4096);
+#else
+  if (posix_memalign(&p, 4096, WAVFILE_BUFSIZE)) p = 0;
+#endif
+  return p;
+}
+
+static void wavfile_free(uint8_t *p) {
+#ifdef _WIN32
+  _aligned_free(p);
+#else
+  free(p);
+#endif
+}
+
+static void *wavfile_thread(void *ptr) {
+  struct wavfile *wav = ptr;
+  pthread_mutex_lock(&wav->mutex);
+  for (;;) {
+    while (wav->written == wav->queued && !wav->closing) {
+      pthread_cond_wait(&wav->cond, &wav->mutex);
+    }
+    if (wav->written == wav->queued) break;
+    unsigned i = wav->written % WAVFILE_BUFS;
+    pthread_mutex_unlock(&wav->mutex);
+    // the buffer is ours until written is advanced
+    bool ok = fwrite(wav->buf[i], 1, wav->len[i], wav->f) == wav->len[i];
+    pthread_mutex_lock(&wav->mutex);
+    if (!ok) wav->error = true;
+    wav->written++;
+    pthread_cond_broadcast(&wav->cond);
+  }
+  pthread_mutex_unlock(&wav->mutex);
+  return 0;
+}
+
+bool wavfile_open(struct wavfile *wav, const char *path, unsigned rate, unsigned channels) {
+  uint8_t h[WAVFILE_HEADER];
+  memset(wav, 0, sizeof(*wav));
+  wav->f = fopen(path, "wb");
+  if (!wav->f) return false;
+  // the buffers are large already
+  setvbuf(wav->f, 0, _IONBF, 0);
+  wav->channels = channels;
+  wavfile_header(h, rate, channels, 0);
+  if (fwrite(h, sizeof(h), 1, wav->f) != 1) goto err;
+  for (int i = 0; i < WAVFILE_BUFS; i++) {
+    wav->buf[i] = wavfile_alloc();
+    if (!wav->buf[i]) goto err;
+  }
+  if (pthread_mutex_init(&wav->mutex, 0)) goto err;
+  if (pthread_cond_init(&wav->cond, 0)) goto err_mutex;
+  if (pthread_create(&wav->thread, 0, wavfile_thread, wav)) goto err_cond;
+  return true;
+err_cond:
+  pthread_cond_destroy(&wav->cond);
+err_mutex:
+  pthread_mutex_destroy(&wav->mutex);
+err:
+  for (int i = 0; i < WAVFILE_BUFS; i++) wavfile_free(wav->buf[i]);
+  fclose(wav->f);
+  wav->f = 0;
+  return false;
+}
+
+// hands the buffer being filled to the thread
+static void wavfile_queue(struct wavfile *wav) {
+  pthread_mutex_lock(&wav->mutex);
+  wav->len[wav->queued % WAVFILE_BUFS] = wav->fill;
+  wav->queued++;
+  pthread_cond_broadcast(&wav->cond);
+  pthread_mutex_unlock(&wav->mutex);
+  wav->fill = 0;
+}
+
+bool wavfile_write(struct wavfile *wav, const int16_t *buf, unsigned frames) {
+  unsigned samples = frames * wav->channels;
+  for (unsigned done = 0; done < samples;) {
+    if (!wav->fill) {
+      // wait for the oldest buffer to be written out
+      pthread_mutex_lock(&wav->mutex);
+      while (wav->queued - wav->written >= WAVFILE_BUFS) {
+        pthread_cond_wait(&wav->cond, &wav->mutex);
+      }
+      bool error = wav->error;
+      pthread_mutex_unlock(&wav->mutex);
+      if (error) return false;
+    }
+    uint8_t *le = wav->buf[wav->queued % WAVFILE_BUFS] + wav->fill;
+    unsigned len = samples - done;
+    if (len > (WAVFILE_BUFSIZE - wav->fill) / 2) len = (WAVFILE_BUFSIZE - wav->fill) / 2;
+    for (unsigned i = 0; i < len; i++) put_le16(le + 2*i, buf[done+i]);
+    wav->fill += 2 * len;
+    done += len;
+    if (wav->fill == WAVFILE_BUFSIZE) wavfile_queue(wav);
+  }
+  wav->frames += frames;
+  return true;
+}
+
+bool wavfile_close(struct wavfile *wav) {
+  uint8_t sizes[4];
+  uint32_t datasize = wav->frames * wav->channels * 2;
+  if (wav->fill) wavfile_queue(wav);
+  pthread_mutex_lock(&wav->mutex);
+  wav->closing = true;
+  pthread_cond_broadcast(&wav->cond);
+  pthread_mutex_unlock(&wav->mutex);
+  pthread_join(wav->thread, 0);
+  pthread_cond_destroy(&wav->cond);
+  pthread_mutex_destroy(&wav->mutex);
+  for (int i = 0; i < WAVFILE_BUFS; i++) wavfile_free(wav->buf[i]);
+  bool ok = !wav->error;
+  put_le32(sizes, 36 + datasize);
+  if (fseek(wav->f, 4, SEEK_SET) || fwrite(sizes, 4, 1, wav->f) != 1) ok = false;
+  put_le32(sizes, datasize);
+  if (fseek(wav->f, 40, SEEK_SET) || fwrite(sizes, 4, 1, wav->f) != 1) ok = false;
+  if (fclose(wav->f)) ok = false;
+  wav->f = 0;
+  return ok;
+}
+
+void wavfile_convert(int16_t *dst, const int32_t *src, unsigned samples) {
+  for (unsigned i = 0; i < samples; i++) {
+    int32_t s = src[i] / 2;
+    if (s > INT16_MAX) s = INT16_MAX;
+    if (s < INT16_MIN) s = INT16_MIN;
+    dst[i] = s;
+  }
+}
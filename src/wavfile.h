@@ -0,0 +1,46 @@
+#ifndef OPNATEST_WAVFILE_H_INCLUDED
+#define OPNATEST_WAVFILE_H_INCLUDED
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#define WAVFILE_BUFSIZE (1 << 20)
+#define WAVFILE_BUFS 4
+
+// 16bit PCM, sizes are filled in on close. data is collected in large
+// buffers that a thread of its own writes out, so the caller can go on
+// rendering while the previous buffer is on its way to disk
+struct wavfile {
+  FILE *f;
+  unsigned channels;
+  uint32_t frames;
+  uint8_t *buf[WAVFILE_BUFS];
+  size_t len[WAVFILE_BUFS];
+  // bytes in buf[queued % WAVFILE_BUFS], the one being filled
+  size_t fill;
+  // buffers handed to the thread and written by it, in order
+  unsigned queued;
+  unsigned written;
+  bool error;
+  bool closing;
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+};
+
+bool wavfile_open(struct wavfile *wav, const char *path, unsigned rate, unsigned channels);
+// interleaved frames, false once any earlier write failed
+bool wavfile_write(struct wavfile *wav, const int16_t *buf, unsigned frames);
+bool wavfile_close(struct wavfile *wav);
+
+#define WAVFILE_HEADER 44
+// the header of a file of frames, for writers that place the data themselves
+void wavfile_header(uint8_t *h, unsigned rate, unsigned channels, uint32_t frames);
+
+// int32 mix to 16bit, halved and clipped like the editor output
+void wavfile_convert(int16_t *dst, const int32_t *src, unsigned samples);
+
+#endif /* OPNATEST_WAVFILE_H_INCLUDED */